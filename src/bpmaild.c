@@ -0,0 +1,704 @@
+#include "bpmaild.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bp.h"
+#include "dedup.h"
+#include "dtpc.h"
+#include "gmime/gmime.h"
+#include "maildir.h"
+#include "mailrecv.h"
+#include "mailsend.h"
+#include "pdeflate.h"
+#include "trace.h"
+
+struct topic {
+    unsigned int topic_id;
+    unsigned int profile_id;
+    char *dest_eid; /* NULL if the topic is only used for receiving */
+    struct dtpcsap_st *sap;
+    pthread_t recv_thread;
+    int recv_started;
+    /* Send counters are only written by the main thread */
+    unsigned long sent;
+    unsigned long send_failures;
+    /* Receive counters are protected by counters_lock */
+    unsigned long delivered;
+    unsigned long duplicates;
+    unsigned long rejected;
+};
+
+static struct sdrv_str *sdr = NULL;
+static struct topic *topics = NULL;
+static size_t topic_cnt = 0;
+static char *spool_dir = NULL;
+static char *deliver_cmd = NULL;
+static struct maildir *maildir = NULL;
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mailrecv_options recv_opts = {0, 1, NULL, NULL, NULL, 1, NULL};
+static int dedup_exact = 0;
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t recv_failed = 0;
+
+static void usage(void) {
+    (void)fprintf(
+        stderr,
+        "%s\n",
+        "usage: bpmaild [--allow-invalid-mime] [--no-verify-ipn |"
+        " -s dns_server_list] -c command | -m maildir [--commit-window ms]"
+        " [-D dedup_file [--dedup-exact] [--dedup-window seconds]]"
+        " [-d spool_dir] [-H state_dir] [-j threads] [-T trace_log]"
+        " topic_id[:profile_id:dest_eid] ..."
+    );
+    exit(EXIT_FAILURE);
+}
+
+static struct option longopts[] = {
+    {"allow-invalid-mime", no_argument, &recv_opts.allow_invalid_mime, 1},
+    {"no-verify-ipn", no_argument, &recv_opts.verify_ipn, 0},
+    {"dedup-exact", no_argument, &dedup_exact, 1},
+    {"dedup-window", required_argument, NULL, 'w'},
+    {"commit-window", required_argument, NULL, 'W'},
+    {NULL, 0, NULL, 0},
+};
+
+/*
+ * Parse an unsigned int from `str`, stopping at the first character that is
+ * not part of the number. `*endptr` is set to that character.
+ * Returns -1 on failure after printing `name` in the error message.
+ */
+static int parse_uint(
+    const char *str,
+    char **endptr,
+    const char *name,
+    unsigned int *val
+) {
+    errno = 0;
+    unsigned long ul = strtoul(str, endptr, 0);
+    if (str == *endptr) {
+        errno = EINVAL;
+    }
+    if (errno != 0) {
+        perror("strtoul");
+        return -1;
+    }
+    if (ul > UINT_MAX) {
+        (void)fprintf(stderr, "%s out of range\n", name);
+        return -1;
+    }
+    *val = (unsigned int)ul;
+    return 0;
+}
+
+/* Parse a topic_id[:profile_id:dest_eid] argument into `t` */
+static int parse_topic(char *arg, struct topic *t) {
+    char *endptr;
+
+    memset(t, 0, sizeof(*t));
+    if (parse_uint(arg, &endptr, "topic_id", &t->topic_id) == -1) {
+        return -1;
+    }
+    if (*endptr == '\0') {
+        return 0;
+    }
+    if (*endptr != ':') {
+        (void)fprintf(stderr, "invalid topic: %s\n", arg);
+        return -1;
+    }
+    if (parse_uint(endptr + 1, &endptr, "profile_id", &t->profile_id) == -1) {
+        return -1;
+    }
+    if (*endptr != ':' || endptr[1] == '\0') {
+        (void)fprintf(stderr, "invalid topic: %s\n", arg);
+        return -1;
+    }
+    t->dest_eid = endptr + 1;
+    return 0;
+}
+
+/*
+ * Pipe `message` to the standard input of the delivery command.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int deliver(const char *message, size_t message_len) {
+    FILE *p = popen(deliver_cmd, "w");
+    if (p == NULL) {
+        perror("popen");
+        return EXIT_FAILURE;
+    }
+    size_t written = fwrite(message, 1, message_len, p);
+    int status = pclose(p);
+    if (written != message_len || status != 0) {
+        (void)fprintf(stderr, "delivery command failed\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void count(unsigned long *counter) {
+    pthread_mutex_lock(&counters_lock);
+    (*counter)++;
+    pthread_mutex_unlock(&counters_lock);
+}
+
+/* A delivery held until its message is committed to the Maildir */
+struct pending_delivery {
+    struct topic *t;
+    DtpcDelivery dlv;
+    struct mailrecv_msg msg;
+    struct pending_delivery *prev;
+    struct pending_delivery *next;
+};
+
+/*
+ * Deliveries queued to the Maildir and not yet committed. Their digests are
+ * not in the duplicate filter yet, so copies are checked against this list.
+ */
+static struct pending_delivery *pending = NULL;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Called with pending_lock held */
+static void pending_remove(struct pending_delivery *p) {
+    if (p->prev != NULL) {
+        p->prev->next = p->next;
+    } else {
+        pending = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->prev = p->prev;
+    }
+}
+
+/*
+ * Returns 1 if a copy of `msg` is queued or was delivered since mailrecv()
+ * checked for duplicates. Called with pending_lock held.
+ */
+static int pending_duplicate(const struct mailrecv_msg *msg) {
+    for (struct pending_delivery *p = pending; p != NULL; p = p->next) {
+        if (memcmp(p->msg.digest, msg->digest, DEDUP_DIGEST_LEN) == 0) {
+            return 1;
+        }
+    }
+    return dedup_check(recv_opts.dedup, msg->digest, time(NULL)) == 1;
+}
+
+/*
+ * Release the delivery to DTPC only once its message is durable. This is the
+ * closest DTPC comes to acknowledging a delivery: dtpc_receive() already took
+ * the ADU off the topic's queue, so a message that was received but not yet
+ * committed is lost if the node crashes, and is not delivered again.
+ */
+static void delivery_committed(void *arg, int ok) {
+    struct pending_delivery *p = arg;
+
+    /* Add the digest to the filter before copies stop seeing it pending */
+    pthread_mutex_lock(&pending_lock);
+    if (ok) {
+        mailrecv_delivered(&recv_opts, &p->msg);
+    }
+    pending_remove(p);
+    pthread_mutex_unlock(&pending_lock);
+
+    count(ok ? &p->t->delivered : &p->t->rejected);
+    dtpc_release_delivery(&p->dlv);
+    free(p);
+}
+
+/*
+ * Queue the message for the next Maildir commit, taking ownership of `dlv`.
+ * Returns 0 on success, 1 if the message is a copy of one that is queued or
+ * was just delivered, and -1 on failure. `dlv` is not released unless 0 is
+ * returned.
+ */
+static int deliver_maildir(
+    struct topic *t,
+    const DtpcDelivery *dlv,
+    const struct mailrecv_msg *msg
+) {
+    struct pending_delivery *p = malloc(sizeof(*p));
+    if (p == NULL) {
+        (void)fprintf(stderr, "malloc failed\n");
+        return -1;
+    }
+    p->t = t;
+    p->dlv = *dlv;
+    p->msg = *msg;
+    p->msg.data = NULL;
+    p->msg.src_eid = p->dlv.srcEid;
+    p->prev = NULL;
+
+    pthread_mutex_lock(&pending_lock);
+    if (recv_opts.dedup != NULL && pending_duplicate(msg)) {
+        pthread_mutex_unlock(&pending_lock);
+        (void)fprintf(stderr, "duplicate message discarded\n");
+        free(p);
+        return 1;
+    }
+    p->next = pending;
+    if (pending != NULL) {
+        pending->prev = p;
+    }
+    pending = p;
+    pthread_mutex_unlock(&pending_lock);
+
+    if (maildir_add(maildir, msg->data, msg->len, &delivery_committed, p)
+        == -1)
+    {
+        pthread_mutex_lock(&pending_lock);
+        pending_remove(p);
+        pthread_mutex_unlock(&pending_lock);
+        free(p);
+        return -1;
+    }
+    return 0;
+}
+
+static void *recv_loop(void *arg) {
+    struct topic *t = arg;
+
+    while (running) {
+        DtpcDelivery dlv;
+
+        if (dtpc_receive(t->sap, &dlv, BP_BLOCKING) != 0) {
+            (void)fprintf(
+                stderr,
+                "topic %u: could not receive DTPC application data unit\n",
+                t->topic_id
+            );
+            /* Stop the daemon rather than keep running with a deaf topic */
+            recv_failed = 1;
+            running = 0;
+            break;
+        }
+
+        if (dlv.result != PayloadPresent) {
+            dtpc_release_delivery(&dlv);
+            continue;
+        }
+
+        struct mailrecv_msg msg;
+        if (mailrecv(sdr, &recv_opts, &dlv, &msg) != EXIT_SUCCESS) {
+            count(&t->rejected);
+        } else if (msg.data == NULL) {
+            count(&t->duplicates);
+        } else if (maildir != NULL) {
+            int ret = deliver_maildir(t, &dlv, &msg);
+            if (ret == 0) {
+                /* Released by delivery_committed() */
+                free(msg.data);
+                continue;
+            }
+            count(ret == 1 ? &t->duplicates : &t->rejected);
+        } else if (deliver(msg.data, msg.len) != EXIT_SUCCESS) {
+            count(&t->rejected);
+        } else {
+            mailrecv_delivered(&recv_opts, &msg);
+            count(&t->delivered);
+        }
+        free(msg.data);
+        dtpc_release_delivery(&dlv);
+    }
+    return NULL;
+}
+
+/*
+ * Read the regular file at `path` into a buffer allocated by malloc().
+ * Returns NULL on failure.
+ */
+static char *read_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror(path);
+        return NULL;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    if (!S_ISREG(sb.st_mode) || sb.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    char *buf = malloc((size_t)sb.st_size);
+    if (buf == NULL) {
+        (void)fprintf(stderr, "malloc failed\n");
+        close(fd);
+        return NULL;
+    }
+    size_t off = 0;
+    while (off < (size_t)sb.st_size) {
+        ssize_t n = read(fd, buf + off, (size_t)sb.st_size - off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror(path);
+            free(buf);
+            close(fd);
+            return NULL;
+        }
+        off += (size_t)n;
+    }
+    close(fd);
+    *len = off;
+    return buf;
+}
+
+/*
+ * Send every message in the spool directory of `t`. Messages that were sent
+ * are removed; the rest are retried on the next pass.
+ */
+static void send_spool(struct topic *t) {
+    char dir[PATH_MAX];
+    if (snprintf(dir, sizeof(dir), "%s/%u", spool_dir, t->topic_id)
+        >= (int)sizeof(dir))
+    {
+        (void)fprintf(stderr, "spool directory path too long\n");
+        return;
+    }
+
+    DIR *dirp = opendir(dir);
+    if (dirp == NULL) {
+        perror(dir);
+        return;
+    }
+    struct dirent *ent;
+    while (running && (ent = readdir(dirp)) != NULL) {
+        /* Writers create dotfiles and rename them once they are complete */
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name)
+            >= (int)sizeof(path))
+        {
+            continue;
+        }
+
+        struct trace trace = {0};
+        int traced = recv_opts.trace_log != NULL && trace_init(&trace) == 0;
+        size_t content_size = 0;
+        char *content = read_file(path, &content_size);
+        if (content == NULL) {
+            continue;
+        }
+        trace.send[TRACE_SEND_READ] = trace_now();
+        struct mailsend_options send_opts = {
+            t->profile_id,
+            t->dest_eid,
+            recv_opts.hdr_state_dir,
+            recv_opts.threads,
+            traced ? &trace : NULL,
+            recv_opts.trace_log,
+        };
+        if (mailsend(t->sap, sdr, &send_opts, content, content_size)
+            == EXIT_SUCCESS)
+        {
+            if (unlink(path) == -1) {
+                perror(path);
+            }
+            t->sent++;
+        } else {
+            t->send_failures++;
+        }
+        free(content);
+    }
+    closedir(dirp);
+}
+
+static void handle_interrupt(int sig) {
+    (void)sig;
+    running = 0;
+    for (size_t i = 0; i < topic_cnt; i++) {
+        dtpc_interrupt(topics[i].sap);
+    }
+}
+
+static void close_topics(void) {
+    for (size_t i = 0; i < topic_cnt; i++) {
+        if (topics[i].sap != NULL) {
+            dtpc_close(topics[i].sap);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    char *servers = NULL;
+    char *dedup_path = NULL;
+    time_t dedup_window = DEDUP_DEFAULT_WINDOW;
+    char *maildir_path = NULL;
+    unsigned int commit_window = MAILDIR_DEFAULT_WINDOW_MS;
+
+    while ((ch = getopt_long(argc, argv, "c:D:d:H:j:m:s:T:", longopts, NULL))
+        != -1)
+    {
+        switch (ch) {
+            case 'c':
+                deliver_cmd = optarg;
+                break;
+            case 'D':
+                dedup_path = optarg;
+                break;
+            case 'd':
+                spool_dir = optarg;
+                break;
+            case 'H':
+                recv_opts.hdr_state_dir = optarg;
+                break;
+            case 'j': {
+                char *endptr;
+                unsigned int jflag;
+                if (parse_uint(optarg, &endptr, "threads", &jflag) == -1
+                    || *endptr != '\0')
+                {
+                    exit(EXIT_FAILURE);
+                }
+                if (jflag == 0 || jflag > PDEFLATE_MAX_THREADS) {
+                    (void)fprintf(stderr, "threads out of range\n");
+                    exit(EXIT_FAILURE);
+                }
+                recv_opts.threads = jflag;
+                break;
+            }
+            case 'm':
+                maildir_path = optarg;
+                break;
+            case 's':
+                servers = optarg;
+                break;
+            case 'T':
+                recv_opts.trace_log = optarg;
+                break;
+            case 'w': {
+                char *endptr;
+                unsigned int wflag;
+                if (parse_uint(optarg, &endptr, "dedup window", &wflag) == -1
+                    || *endptr != '\0')
+                {
+                    exit(EXIT_FAILURE);
+                }
+                if (wflag == 0 || wflag > INT_MAX) {
+                    (void)fprintf(stderr, "dedup window out of range\n");
+                    exit(EXIT_FAILURE);
+                }
+                dedup_window = (time_t)wflag;
+                break;
+            }
+            case 'W': {
+                char *endptr;
+                if (parse_uint(optarg, &endptr, "commit window", &commit_window)
+                        == -1
+                    || *endptr != '\0')
+                {
+                    exit(EXIT_FAILURE);
+                }
+                if (commit_window > 60000) {
+                    (void)fprintf(stderr, "commit window out of range\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 0:
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc == 0 || (deliver_cmd == NULL) == (maildir_path == NULL)) {
+        usage();
+    }
+
+    topic_cnt = (size_t)argc;
+    topics = calloc(topic_cnt, sizeof(*topics));
+    if (topics == NULL) {
+        (void)fprintf(stderr, "calloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    int sending = 0;
+    for (size_t i = 0; i < topic_cnt; i++) {
+        if (parse_topic(argv[i], &topics[i]) == -1) {
+            free(topics);
+            exit(EXIT_FAILURE);
+        }
+        if (topics[i].dest_eid != NULL) {
+            sending = 1;
+        }
+    }
+    if (sending && spool_dir == NULL) {
+        free(topics);
+        usage();
+    }
+
+    if (recv_opts.verify_ipn
+        && mailrecv_resolver_init(&recv_opts.channel, servers) != EXIT_SUCCESS)
+    {
+        free(topics);
+        exit(EXIT_FAILURE);
+    }
+
+    if (dedup_path != NULL) {
+        recv_opts.dedup = dedup_open(dedup_path, dedup_window, dedup_exact);
+        if (recv_opts.dedup == NULL) {
+            free(topics);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    g_mime_init();
+
+    if (dtpc_attach() != 0) {
+        (void)fprintf(stderr, "could not attach to DTPC\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < topic_cnt; i++) {
+        if (dtpc_open(topics[i].topic_id, NULL, &topics[i].sap) != 0) {
+            (void)fprintf(
+                stderr,
+                "could not open topic %u\n",
+                topics[i].topic_id
+            );
+            topics[i].sap = NULL;
+            close_topics();
+            dtpc_detach();
+            exit(EXIT_FAILURE);
+        }
+        if (topics[i].dest_eid != NULL) {
+            char dir[PATH_MAX];
+            if (snprintf(
+                    dir,
+                    sizeof(dir),
+                    "%s/%u",
+                    spool_dir,
+                    topics[i].topic_id
+                )
+                    >= (int)sizeof(dir)
+                || (mkdir(dir, 0700) == -1 && errno != EEXIST))
+            {
+                (void)fprintf(stderr, "could not create %s\n", dir);
+                close_topics();
+                dtpc_detach();
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    if (maildir_path != NULL) {
+        maildir = maildir_open(maildir_path, commit_window);
+        if (maildir == NULL) {
+            close_topics();
+            dtpc_detach();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sdr = bp_get_sdr();
+    if (sdr == NULL) {
+        (void)fprintf(stderr, "could not obtain handle for SDR\n");
+        close_topics();
+        dtpc_detach();
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction act = {0};
+    act.sa_handler = &handle_interrupt;
+    if (sigaction(SIGINT, &act, NULL) == -1
+        || sigaction(SIGTERM, &act, NULL) == -1)
+    {
+        perror("sigaction");
+        close_topics();
+        dtpc_detach();
+        exit(EXIT_FAILURE);
+    }
+    /* A delivery command that exits early must not terminate the daemon */
+    struct sigaction ign = {0};
+    ign.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &ign, NULL) == -1) {
+        perror("sigaction");
+        close_topics();
+        dtpc_detach();
+        exit(EXIT_FAILURE);
+    }
+
+    int retval = EXIT_SUCCESS;
+    for (size_t i = 0; i < topic_cnt; i++) {
+        int err = pthread_create(
+            &topics[i].recv_thread,
+            NULL,
+            &recv_loop,
+            &topics[i]
+        );
+        if (err != 0) {
+            (void)fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            running = 0;
+            retval = EXIT_FAILURE;
+            break;
+        }
+        topics[i].recv_started = 1;
+    }
+
+    while (running) {
+        for (size_t i = 0; i < topic_cnt; i++) {
+            if (topics[i].dest_eid != NULL) {
+                send_spool(&topics[i]);
+            }
+        }
+        sleep(1);
+    }
+
+    for (size_t i = 0; i < topic_cnt; i++) {
+        dtpc_interrupt(topics[i].sap);
+    }
+    for (size_t i = 0; i < topic_cnt; i++) {
+        if (topics[i].recv_started) {
+            pthread_join(topics[i].recv_thread, NULL);
+        }
+    }
+    /* Commit and release the deliveries still pending before counting */
+    maildir_close(maildir);
+    if (recv_failed) {
+        retval = EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < topic_cnt; i++) {
+        struct topic *t = &topics[i];
+        (void)fprintf(
+            stderr,
+            "topic %u: %lu sent, %lu send failures, %lu delivered,"
+            " %lu duplicates, %lu rejected\n",
+            t->topic_id,
+            t->sent,
+            t->send_failures,
+            t->delivered,
+            t->duplicates,
+            t->rejected
+        );
+    }
+
+    close_topics();
+    dtpc_detach();
+    g_mime_shutdown();
+    dedup_close(recv_opts.dedup);
+    if (recv_opts.verify_ipn) {
+        mailrecv_resolver_destroy(recv_opts.channel);
+    }
+    free(topics);
+    return retval;
+}
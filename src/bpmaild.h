@@ -0,0 +1,6 @@
+#ifndef BPMAILD_H
+#define BPMAILD_H
+
+#include "global.h"
+
+#endif /* BPMAILD_H */
@@ -4,161 +4,43 @@
 #include <getopt.h>
 #include <limits.h>
 #include <signal.h>
-#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-#include "ares.h"
 #include "bp.h"
+#include "dedup.h"
 #include "dtpc.h"
 #include "gmime/gmime.h"
-#include "zlib.h"
+#include "mailrecv.h"
+#include "pdeflate.h"
 
 static struct sdrv_str *sdr = NULL;
 static struct dtpcsap_st *sap = NULL;
-static int allow_invalid_mime = 0;
-static int verify_ipn = 1;
-static ares_channel_t *channel = NULL;
-
-struct ipn_verify {
-    unsigned long long node_nbr;
-    int success;
-};
+static struct mailrecv_options recv_opts = {0, 1, NULL, NULL, NULL, 1, NULL};
+static int dedup_exact = 0;
 
 static void usage(void) {
     (void)fprintf(
         stderr,
         "%s\n",
         "usage: bpmailrecv [--allow-invalid-mime] [--no-verify-ipn |"
-        " -s dns_server_list] [-t topic_id]"
+        " -s dns_server_list] [-D dedup_file [--dedup-exact]"
+        " [--dedup-window seconds]] [-H state_dir] [-j threads] [-T trace_log]"
+        " [-t topic_id]"
     );
     exit(EXIT_FAILURE);
 }
 
 static struct option longopts[] = {
-    {"allow-invalid-mime", no_argument, &allow_invalid_mime, 1},
-    {"no-verify-ipn", no_argument, &verify_ipn, 0},
+    {"allow-invalid-mime", no_argument, &recv_opts.allow_invalid_mime, 1},
+    {"no-verify-ipn", no_argument, &recv_opts.verify_ipn, 0},
+    {"dedup-exact", no_argument, &dedup_exact, 1},
+    {"dedup-window", required_argument, NULL, 'w'},
     {NULL, 0, NULL, 0},
 };
 
-/*
- * Decompress zlib data dynamically using the inflate API.
- * On success, returns a Bytef * pointing to data allocated by malloc(). The
- * caller is responsible for calling free().
- * Returns NULL on failure.
- */
-static Bytef *inflate_dynamic(const Bytef *in, size_t in_len, size_t *out_len) {
-    int ret;
-    z_stream strm;
-    Bytef *out = NULL;
-    size_t out_capacity = 16384; /* Start with 16KB */
-    size_t out_size = 0;
-
-    out = malloc(out_capacity);
-    if (out == NULL) {
-        return NULL;
-    }
-
-    memset(&strm, 0, sizeof(strm));
-
-    /* zlib only accepts uInt for avail_in, so we must check and cast safely */
-    if (in_len > UINT_MAX) {
-        free(out);
-        return NULL; /* input too large for zlib */
-    }
-
-    strm.next_in = (Bytef *)(uintptr_t)in; /* safe cast from const */
-    strm.avail_in = (uInt)in_len;
-
-    if (inflateInit(&strm) != Z_OK) {
-        free(out);
-        return NULL;
-    }
-
-    do {
-        size_t remaining = out_capacity - out_size;
-
-        /* zlib requires avail_out to be uInt */
-        if (remaining > UINT_MAX) {
-            inflateEnd(&strm);
-            free(out);
-            return NULL; /* chunk too big for zlib */
-        }
-
-        strm.avail_out = (uInt)remaining;
-        strm.next_out = out + out_size;
-
-        ret = inflate(&strm, Z_NO_FLUSH);
-        if (ret == Z_STREAM_ERROR || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
-        {
-            inflateEnd(&strm);
-            free(out);
-            return NULL;
-        }
-
-        out_size = strm.total_out;
-
-        /* If output buffer is full, grow it */
-        if (ret != Z_STREAM_END && strm.avail_out == 0) {
-            out_capacity *= 2;
-            Bytef *tmp = realloc(out, out_capacity);
-            if (tmp == NULL) {
-                inflateEnd(&strm);
-                free(out);
-                return NULL;
-            }
-            out = tmp;
-        }
-    } while (ret != Z_STREAM_END);
-
-    *out_len = out_size;
-
-    inflateEnd(&strm);
-    return out;
-}
-
-static void dnsrec_cb(
-    void *arg,
-    ares_status_t status,
-    size_t timeouts,
-    const ares_dns_record_t *dnsrec
-) {
-    (void)timeouts;
-    if (dnsrec == NULL || status != ARES_SUCCESS) {
-        return;
-    }
-    struct ipn_verify *res = arg;
-
-    res->success = 0;
-    size_t rr_cnt = ares_dns_record_rr_cnt(dnsrec, ARES_SECTION_ANSWER);
-    for (size_t i = 0; i < rr_cnt; i++) {
-        const ares_dns_rr_t *rr =
-            ares_dns_record_rr_get_const(dnsrec, ARES_SECTION_ANSWER, i);
-        if (rr == NULL) {
-            (void)fprintf(stderr, "ares_dns_record_rr_get_const: misuse\n");
-            return;
-        }
-
-        if (ares_dns_rr_get_type(rr) != ARES_REC_TYPE_RAW_RR) {
-            continue;
-        }
-
-        size_t len; /* TODO: do we need to keep track of len? */
-        const unsigned char *data =
-            ares_dns_rr_get_bin(rr, ARES_RR_RAW_RR_DATA, &len);
-        uint64_t r_node_nbr = 0;
-        /* data is big endian */
-        for (size_t j = 0; j < sizeof(uint64_t); j++) {
-            r_node_nbr = (r_node_nbr << 8) | data[j];
-        }
-        if (res->node_nbr == r_node_nbr) {
-            res->success = 1;
-            return;
-        }
-    }
-}
-
 static int bpmailrecv(void) {
     DtpcDelivery dlv;
 
@@ -172,219 +54,26 @@ static int bpmailrecv(void) {
         return EXIT_SUCCESS;
     }
 
-    char *received_data = malloc(dlv.length);
-    if (received_data == NULL) {
-        (void)fprintf(stderr, "malloc failed\n");
-        dtpc_release_delivery(&dlv);
-        return EXIT_FAILURE;
-    }
-
-    sdr_read(sdr, received_data, dlv.item, dlv.length);
-
-    size_t decompressed_size = 0;
-    Bytef *decompressed = inflate_dynamic(
-        (const Bytef *)(received_data),
-        dlv.length,
-        &decompressed_size
-    );
-    free(received_data);
-    if (decompressed == NULL) {
-        (void)fprintf(stderr, "decompression failed\n");
-        dtpc_release_delivery(&dlv);
-        return EXIT_FAILURE;
-    }
-
-    g_mime_init();
-
-    GMimeStream *istream = g_mime_stream_mem_new_with_buffer(
-        (char *)decompressed,
-        decompressed_size
-    );
-    if (istream == NULL) {
-        (void)fprintf(stderr, "could not create new GMime memory stream\n");
-        free(decompressed);
+    struct mailrecv_msg msg;
+    if (mailrecv(sdr, &recv_opts, &dlv, &msg) != EXIT_SUCCESS) {
         dtpc_release_delivery(&dlv);
         return EXIT_FAILURE;
     }
-
-    /* GObject construction can never fail; parser should never be NULL */
-    GMimeParser *parser = g_mime_parser_new_with_stream(istream);
-    g_object_unref(istream);
-
-    GMimeMessage *message = g_mime_parser_construct_message(parser, NULL);
-    g_object_unref(parser);
-    if (message == NULL) {
-        (void)fprintf(stderr, "could not parse MIME message\n");
-        if (allow_invalid_mime) {
-            (void)fwrite(decompressed, 1, decompressed_size, stdout);
-            (void)fflush(stdout);
-        }
-        free(decompressed);
+    if (msg.data == NULL) {
         dtpc_release_delivery(&dlv);
-        if (allow_invalid_mime) {
-            return EXIT_SUCCESS;
-        }
-        return EXIT_FAILURE;
-    }
-    free(decompressed);
-
-    /*
-     * From this point, we assume `message` is a valid MIME message.
-     * (GMime does not accept some values that should be valid, such as
-     * From: Managing Partners:ben@example.com,carol@example.com;
-     * (taken from Section 4 of RFC 6854).)
-     * So ignore `allow_invalid_mime` and treat a failure to parse a header
-     * as a failure to verify the source EID.
-     */
-
-    if (verify_ipn) {
-        /* Parse source EID */
-        if (strncmp("ipn:", dlv.srcEid, 4)) {
-            (void)fprintf(stderr, "source EID does not use ipn URI scheme\n");
-            g_object_unref(message);
-            dtpc_release_delivery(&dlv);
-            return EXIT_FAILURE;
-        }
-        char *node_nbr_str = malloc(strlen(dlv.srcEid) - 4);
-        if (node_nbr_str == NULL) {
-            perror("malloc");
-            g_object_unref(message);
-            dtpc_release_delivery(&dlv);
-            return EXIT_FAILURE;
-        }
-        *node_nbr_str = '\0';
-        const char *start = dlv.srcEid + 4;
-        strncat(node_nbr_str, start, strcspn(start, "."));
-        errno = 0;
-        char *endptr;
-        unsigned long long node_nbr = strtoull(node_nbr_str, &endptr, 0);
-        if (node_nbr_str == endptr) {
-            errno = EINVAL;
-        }
-        if (errno != 0) {
-            perror("strtoull");
-            g_object_unref(message);
-            dtpc_release_delivery(&dlv);
-            return EXIT_FAILURE;
-        }
-        free(node_nbr_str);
-
-        InternetAddressList *list = g_mime_message_get_from(message);
-        if (list == NULL) {
-            (void)fprintf(
-                stderr,
-                "could not extract mailbox-list from RFC5322.From header\n"
-            );
-            g_object_unref(message);
-            dtpc_release_delivery(&dlv);
-            return EXIT_FAILURE;
-        }
-        for (int i = 0; i < internet_address_list_length(list); i++) {
-            InternetAddressMailbox *mb = (InternetAddressMailbox *)
-                internet_address_list_get_address(list, i);
-            if (mb == NULL) {
-                (void)fprintf(
-                    stderr,
-                    "could not extract mailbox from mailbox-list\n"
-                );
-                g_object_unref(message);
-                dtpc_release_delivery(&dlv);
-                return EXIT_FAILURE;
-            }
-            if (mb->addr == NULL) {
-                (void)fprintf(stderr, "could not extract addr from mailbox\n");
-                g_object_unref(message);
-                dtpc_release_delivery(&dlv);
-                return EXIT_FAILURE;
-            }
-            const char *idn_addr = internet_address_mailbox_get_idn_addr(mb);
-            if (idn_addr == NULL) {
-                (void)fprintf(stderr, "could not get IDN encoded addr-spec\n");
-                g_object_unref(message);
-                dtpc_release_delivery(&dlv);
-                return EXIT_FAILURE;
-            }
-            const char *domain = idn_addr + mb->at + 1;
-
-            struct ipn_verify res = {node_nbr, 0};
-
-            /* Perform query */
-            ares_status_t status = ares_query_dnsrec(
-                channel,
-                domain,
-                ARES_CLASS_IN,
-                264, /* IPN RRTYPE value */
-                dnsrec_cb,
-                &res,
-                NULL
-            );
-            if (status != ARES_SUCCESS) {
-                (void)fprintf(
-                    stderr,
-                    "failed to enqueue query: %s\n",
-                    ares_strerror((int)status)
-                );
-                g_object_unref(message);
-                dtpc_release_delivery(&dlv);
-                return EXIT_FAILURE;
-            }
-
-            /* Wait until no more requests are left to be processed */
-            ares_queue_wait_empty(channel, -1);
-
-            if (!res.success) {
-                (void)fprintf(stderr, "IPN verification failed\n");
-                g_object_unref(message);
-                dtpc_release_delivery(&dlv);
-                return EXIT_FAILURE;
-            }
-        }
-    }
-
-    while (g_mime_header_list_contains(
-        message->parent_object.headers,
-        "Return-Path"
-    ))
-    {
-        g_mime_header_list_remove(
-            message->parent_object.headers,
-            "Return-Path"
-        );
+        return EXIT_SUCCESS;
     }
 
-    GMimeStream *ostream = g_mime_stream_pipe_new(fileno(stdout));
-    if (ostream == NULL) {
-        (void)fprintf(stderr, "could not create stream pipe around stdout\n");
-        g_object_unref(ostream);
-        g_object_unref(message);
-        dtpc_release_delivery(&dlv);
-        return EXIT_FAILURE;
-    }
-    g_mime_stream_pipe_set_owner((GMimeStreamPipe *)ostream, FALSE);
-    /*
-     * g_mime_format_options_new() uses g_slice_new() which can never return
-     * NULL.
-     */
-    GMimeFormatOptions *format = g_mime_format_options_new();
-    g_mime_format_options_set_newline_format(format, GMIME_NEWLINE_FORMAT_DOS);
-    if (g_mime_object_write_to_stream((GMimeObject *)message, format, ostream)
-        == -1)
+    if (fwrite(msg.data, 1, msg.len, stdout) != msg.len
+        || fflush(stdout) == EOF)
     {
         (void)fprintf(stderr, "could not write data to stdout\n");
-        g_object_unref(ostream);
-        g_object_unref(message);
-        dtpc_release_delivery(&dlv);
-        return EXIT_FAILURE;
-    }
-    if (g_mime_stream_flush(ostream) == -1) {
-        (void)fprintf(stderr, "could not sync stream to disk\n");
-        g_object_unref(ostream);
-        g_object_unref(message);
+        free(msg.data);
         dtpc_release_delivery(&dlv);
         return EXIT_FAILURE;
     }
-    g_object_unref(ostream);
-    g_object_unref(message);
+    free(msg.data);
+    mailrecv_delivered(&recv_opts, &msg);
 
     dtpc_release_delivery(&dlv);
     return EXIT_SUCCESS;
@@ -399,9 +88,42 @@ int main(int argc, char **argv) {
     int ch;
     unsigned int topic_id = 25;
     char *servers = NULL;
+    char *dedup_path = NULL;
+    time_t dedup_window = DEDUP_DEFAULT_WINDOW;
 
-    while ((ch = getopt_long(argc, argv, "t:s:", longopts, NULL)) != -1) {
+    while ((ch = getopt_long(argc, argv, "D:H:j:T:t:s:", longopts, NULL))
+        != -1)
+    {
         switch (ch) {
+            case 'D':
+                dedup_path = optarg;
+                break;
+            case 'H':
+                recv_opts.hdr_state_dir = optarg;
+                break;
+            case 'j': {
+                errno = 0;
+                char *endptr;
+                unsigned long jflag = strtoul(optarg, &endptr, 0);
+                if (optarg == endptr) {
+                    errno = EINVAL;
+                }
+                if (errno != 0) {
+                    perror("strtoul");
+                    free(servers);
+                    exit(EXIT_FAILURE);
+                }
+                if (jflag == 0 || jflag > PDEFLATE_MAX_THREADS) {
+                    (void)fprintf(stderr, "threads out of range\n");
+                    free(servers);
+                    exit(EXIT_FAILURE);
+                }
+                recv_opts.threads = (unsigned int)jflag;
+                break;
+            }
+            case 'T':
+                recv_opts.trace_log = optarg;
+                break;
             case 't': {
                 errno = 0;
                 char *endptr;
@@ -425,6 +147,26 @@ int main(int argc, char **argv) {
             case 's':
                 servers = strdup(optarg);
                 break;
+            case 'w': {
+                errno = 0;
+                char *endptr;
+                unsigned long wflag = strtoul(optarg, &endptr, 0);
+                if (optarg == endptr) {
+                    errno = EINVAL;
+                }
+                if (errno != 0) {
+                    perror("strtoul");
+                    free(servers);
+                    exit(EXIT_FAILURE);
+                }
+                if (wflag == 0 || wflag > INT_MAX) {
+                    (void)fprintf(stderr, "dedup window out of range\n");
+                    free(servers);
+                    exit(EXIT_FAILURE);
+                }
+                dedup_window = (time_t)wflag;
+                break;
+            }
             case 0:
                 break;
             default:
@@ -440,50 +182,25 @@ int main(int argc, char **argv) {
         usage();
     }
 
-    if (verify_ipn) {
-        int status;
-        status = ares_library_init(ARES_LIB_INIT_ALL);
-        if (status != ARES_SUCCESS) {
-            (void)fprintf(
-                stderr,
-                "c-ares library initialization issue: %s\n",
-                ares_strerror(status)
-            );
-            free(servers);
-            exit(EXIT_FAILURE);
-        }
-        if (!ares_threadsafety()) {
-            (void)fprintf(stderr, "c-ares not compiled with thread support\n");
-            free(servers);
+    if (recv_opts.verify_ipn) {
+        int status = mailrecv_resolver_init(&recv_opts.channel, servers);
+        free(servers);
+        if (status != EXIT_SUCCESS) {
             exit(EXIT_FAILURE);
         }
+    } else {
+        free(servers);
+    }
 
-        struct ares_options options = {0};
-        int optmask = 0;
-        optmask |= ARES_OPT_EVENT_THREAD;
-        options.evsys = ARES_EVSYS_DEFAULT;
-
-        status = ares_init_options(&channel, &options, optmask);
-        if (status != ARES_SUCCESS) {
-            (void)fprintf(
-                stderr,
-                "c-ares initialization issue: %s\n",
-                ares_strerror(status)
-            );
-            free(servers);
+    if (dedup_path != NULL) {
+        recv_opts.dedup = dedup_open(dedup_path, dedup_window, dedup_exact);
+        if (recv_opts.dedup == NULL) {
             exit(EXIT_FAILURE);
         }
-
-        if (servers != NULL) {
-            status = ares_set_servers_csv(channel, servers);
-            free(servers);
-            if (status != ARES_SUCCESS) {
-                (void)fprintf(stderr, "invalid format for list of servers\n");
-                exit(EXIT_FAILURE);
-            }
-        }
     }
 
+    g_mime_init();
+
     if (dtpc_attach() != 0) {
         (void)fprintf(stderr, "could not attach to DTPC\n");
         exit(EXIT_FAILURE);
@@ -516,9 +233,10 @@ int main(int argc, char **argv) {
 
     dtpc_close(sap);
     dtpc_detach();
-    if (verify_ipn) {
-        ares_destroy(channel);
-        ares_library_cleanup();
+    g_mime_shutdown();
+    dedup_close(recv_opts.dedup);
+    if (recv_opts.verify_ipn) {
+        mailrecv_resolver_destroy(recv_opts.channel);
     }
     return retval;
 }
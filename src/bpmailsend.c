@@ -8,10 +8,12 @@
 
 #include "bp.h"
 #include "dtpc.h"
-#include "zlib.h"
+#include "mailsend.h"
+#include "pdeflate.h"
+#include "trace.h"
 
-static char *dest_eid = NULL;
-static unsigned int profile_id = 0;
+static struct mailsend_options send_opts = {0, NULL, NULL, 1, NULL, NULL};
+static struct trace trace;
 static struct dtpcsap_st *sap = NULL;
 static struct sdrv_str *sdr = NULL;
 
@@ -19,12 +21,17 @@ static void usage(void) {
     (void)fprintf(
         stderr,
         "%s\n",
-        "usage: bpmailsend [-t topic_id] profile_id dest_eid"
+        "usage: bpmailsend [-H state_dir] [-j threads] [-T trace_log]"
+        " [-t topic_id] profile_id dest_eid"
     );
     exit(EXIT_FAILURE);
 }
 
 static int bpmailsend(void) {
+    if (send_opts.trace_log != NULL && trace_init(&trace) == 0) {
+        send_opts.trace = &trace;
+    }
+
     /*
      * TODO: we're currently reading from stdin, storing it in a malloc'd
      * buffer, and then copying that buffer into the SDR for our bundle's
@@ -44,105 +51,11 @@ static int bpmailsend(void) {
         );
         return EXIT_FAILURE;
     }
+    trace.send[TRACE_SEND_READ] = trace_now();
 
-    /*
-     * TODO: DTPC API uses unsigned int to specify content size, so we can't
-     * send more than UINT_MAX at once. We should allocate and send multiple
-     * times rather than just once.
-     */
-    if (content_size > UINT_MAX) {
-        (void)fprintf(stderr, "content too large to send\n");
-        free(content);
-        return EXIT_FAILURE;
-    }
-
-    /* Compress content using zlib */
-    uLong compressed_size = compressBound((uLong)content_size);
-    Bytef *compressed = malloc(compressed_size);
-    if (compressed == NULL) {
-        fprintf(stderr, "malloc failed\n");
-        free(content);
-        return EXIT_FAILURE;
-    }
-
-    if (compress(
-            compressed,
-            &compressed_size,
-            (Bytef *)content,
-            (uLong)content_size
-        )
-        != Z_OK)
-    {
-        fprintf(stderr, "compression failed\n");
-        free(content);
-        free(compressed);
-        return EXIT_FAILURE;
-    }
-    free(content); /* free original data once compressed */
-
-    if (sdr_begin_xn(sdr) == 0) {
-        (void)fprintf(stderr, "could not initiate a SDR transaction\n");
-        free(compressed);
-        return EXIT_FAILURE;
-    }
-    /*
-     * TODO: verify if we need this check
-     * if (sdr_heap_depleted(sdr) != 0) {
-     *     sdr_exit_xn(sdr);
-     *     (void)fprintf(stderr, "could not send mail; SDR low on heap space\n");
-     *     return EXIT_FAILURE;
-     * }
-     */
-
-    SdrObject adu_payload =
-        sdr_insert(sdr, (char *)compressed, (unsigned long)compressed_size);
-    if (sdr_end_xn(sdr) != 0) {
-        (void)fprintf(stderr, "could not copy data into SDR\n");
-        free(compressed);
-        return EXIT_FAILURE;
-    }
-
-    switch (dtpc_send(
-        profile_id,
-        sap,
-        dest_eid,
-        0,
-        0,
-        0,
-        0,
-        NULL,
-        0,
-        NoCustodyRequested,
-        NULL,
-        BP_STD_PRIORITY,
-        adu_payload,
-        (unsigned int)compressed_size
-    ))
-    {
-        case -1:
-            (void)fprintf(stderr, "system failure from dtpc_send\n");
-            free(compressed);
-            return EXIT_FAILURE;
-        case 0:
-            (void)fprintf(stderr, "could not send payload\n");
-            free(compressed);
-            if (sdr_begin_xn(sdr) == 0) {
-                (void)fprintf(stderr, "could not initiate a SDR transaction\n");
-                return EXIT_FAILURE;
-            }
-            sdr_free(sdr, adu_payload);
-            if (sdr_end_xn(sdr) != 0) {
-                (void)fprintf(stderr, "could not free ADU memory from SDR\n");
-            }
-            return EXIT_FAILURE;
-        case 1:
-            /* Fall through */
-        default:
-            break;
-    }
-
-    free(compressed);
-    return EXIT_SUCCESS;
+    int retval = mailsend(sap, sdr, &send_opts, content, (size_t)content_size);
+    free(content);
+    return retval;
 }
 
 int main(int argc, char **argv) {
@@ -150,8 +63,31 @@ int main(int argc, char **argv) {
     char *endptr;
     unsigned int topic_id = 25;
 
-    while ((ch = getopt(argc, argv, "t:")) != -1) {
+    while ((ch = getopt(argc, argv, "H:j:T:t:")) != -1) {
         switch (ch) {
+            case 'H':
+                send_opts.hdr_state_dir = optarg;
+                break;
+            case 'j': {
+                errno = 0;
+                unsigned long jflag = strtoul(optarg, &endptr, 0);
+                if (optarg == endptr) {
+                    errno = EINVAL;
+                }
+                if (errno != 0) {
+                    perror("strtoul");
+                    exit(EXIT_FAILURE);
+                }
+                if (jflag == 0 || jflag > PDEFLATE_MAX_THREADS) {
+                    (void)fprintf(stderr, "threads out of range\n");
+                    exit(EXIT_FAILURE);
+                }
+                send_opts.threads = (unsigned int)jflag;
+                break;
+            }
+            case 'T':
+                send_opts.trace_log = optarg;
+                break;
             case 't': {
                 errno = 0;
                 unsigned long tflag = strtoul(optarg, &endptr, 0);
@@ -194,9 +130,9 @@ int main(int argc, char **argv) {
         (void)fprintf(stderr, "profile_id out of range\n");
         exit(EXIT_FAILURE);
     }
-    profile_id = (unsigned int)_profile_id;
+    send_opts.profile_id = (unsigned int)_profile_id;
 
-    dest_eid = argv[1];
+    send_opts.dest_eid = argv[1];
 
     if (dtpc_attach() != 0) {
         (void)fprintf(stderr, "could not attach to DTPC\n");
@@ -0,0 +1,380 @@
+#include "bpmailtrace.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_FIELDS 32
+/* Histogram buckets; bucket i > 0 holds [2^(i-1), 2^i) microseconds */
+#define BUCKETS 48
+#define BAR_WIDTH 40
+
+struct stage {
+    char *name;
+    int64_t *values;
+    size_t cnt;
+    size_t cap;
+};
+
+struct group {
+    char *name;
+    size_t spans;
+    struct stage *stages;
+    size_t stage_cnt;
+};
+
+static struct group *groups = NULL;
+static size_t group_cnt = 0;
+static int quiet = 0;
+
+static void usage(void) {
+    (void)fprintf(stderr, "%s\n", "usage: bpmailtrace [-q] [trace_log ...]");
+    exit(EXIT_FAILURE);
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (p == NULL) {
+        (void)fprintf(stderr, "realloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static char *xstrdup(const char *s) {
+    char *p = strdup(s);
+    if (p == NULL) {
+        (void)fprintf(stderr, "strdup failed\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static struct group *get_group(const char *name) {
+    for (size_t i = 0; i < group_cnt; i++) {
+        if (strcmp(groups[i].name, name) == 0) {
+            return &groups[i];
+        }
+    }
+    groups = xrealloc(groups, (group_cnt + 1) * sizeof(*groups));
+    struct group *g = &groups[group_cnt++];
+    memset(g, 0, sizeof(*g));
+    g->name = xstrdup(name);
+    return g;
+}
+
+static void add_value(struct group *g, const char *name, int64_t value) {
+    struct stage *s = NULL;
+    for (size_t i = 0; i < g->stage_cnt; i++) {
+        if (strcmp(g->stages[i].name, name) == 0) {
+            s = &g->stages[i];
+            break;
+        }
+    }
+    if (s == NULL) {
+        g->stages =
+            xrealloc(g->stages, (g->stage_cnt + 1) * sizeof(*g->stages));
+        s = &g->stages[g->stage_cnt++];
+        memset(s, 0, sizeof(*s));
+        s->name = xstrdup(name);
+    }
+    if (s->cnt == s->cap) {
+        s->cap = s->cap == 0 ? 64 : s->cap * 2;
+        s->values = xrealloc(s->values, s->cap * sizeof(*s->values));
+    }
+    s->values[s->cnt++] = value;
+}
+
+/* The node of `eid`: "ipn:N" for ipn EIDs, the whole EID otherwise */
+static void eid_node(const char *eid, char *node, size_t node_len) {
+    size_t len = strlen(eid);
+    if (strncmp(eid, "ipn:", 4) == 0) {
+        const char *dot = strchr(eid, '.');
+        if (dot != NULL) {
+            len = (size_t)(dot - eid);
+        }
+    }
+    (void)snprintf(node, node_len, "%.*s", (int)len, eid);
+}
+
+/*
+ * Add the span on `line` to the group of all spans on the same side and to
+ * the group of its peer node.
+ * Returns -1 if the line is malformed.
+ */
+static int add_span(char *line) {
+    char *save;
+    char *side = strtok_r(line, " \n", &save);
+    const char *all_name;
+    const char *peer_key;
+    const char *peer_fmt;
+    if (side != NULL && strcmp(side, "recv") == 0) {
+        all_name = "received from all nodes";
+        peer_key = "src";
+        peer_fmt = "received from %s";
+    } else if (side != NULL && strcmp(side, "send") == 0) {
+        all_name = "sent to all nodes";
+        peer_key = "dest";
+        peer_fmt = "sent to %s";
+    } else {
+        return -1;
+    }
+
+    const char *peer = NULL;
+    const char *names[MAX_FIELDS];
+    int64_t values[MAX_FIELDS];
+    size_t field_cnt = 0;
+    char *field;
+    while ((field = strtok_r(NULL, " \n", &save)) != NULL) {
+        char *eq = strchr(field, '=');
+        if (eq == NULL) {
+            return -1;
+        }
+        *eq = '\0';
+        const char *value = eq + 1;
+        if (strcmp(field, peer_key) == 0) {
+            peer = value;
+            continue;
+        }
+        if (strcmp(field, "id") == 0 || strcmp(field, "time") == 0) {
+            continue;
+        }
+        if (field_cnt == MAX_FIELDS) {
+            return -1;
+        }
+        char *endptr;
+        errno = 0;
+        long long ll = strtoll(value, &endptr, 10);
+        if (errno != 0 || endptr == value || *endptr != '\0') {
+            return -1;
+        }
+        names[field_cnt] = field;
+        values[field_cnt++] = (int64_t)ll;
+    }
+    if (peer == NULL || field_cnt == 0) {
+        return -1;
+    }
+
+    char node[256];
+    char peer_name[sizeof(node) + 32];
+    eid_node(peer, node, sizeof(node));
+    (void)snprintf(peer_name, sizeof(peer_name), peer_fmt, node);
+    /* get_group() may move the groups, so fill one at a time */
+    const char *group_names[] = {all_name, peer_name};
+    for (size_t i = 0; i < 2; i++) {
+        struct group *g = get_group(group_names[i]);
+        g->spans++;
+        for (size_t j = 0; j < field_cnt; j++) {
+            add_value(g, names[j], values[j]);
+        }
+    }
+    return 0;
+}
+
+static int read_log(FILE *f, const char *name, unsigned long *malformed) {
+    char *line = NULL;
+    size_t cap = 0;
+    while (getline(&line, &cap, f) != -1) {
+        if (add_span(line) == -1) {
+            (*malformed)++;
+        }
+    }
+    int ret = ferror(f) ? -1 : 0;
+    if (ret == -1) {
+        perror(name);
+    }
+    free(line);
+    return ret;
+}
+
+/* Format `us` microseconds for humans */
+static void format_us(char *buf, size_t len, int64_t us) {
+    int64_t abs_us = us < 0 ? -us : us;
+    if (abs_us < 1000) {
+        (void)snprintf(buf, len, "%lldus", (long long)us);
+    } else if (abs_us < 1000000) {
+        (void)snprintf(buf, len, "%.1fms", (double)us / 1000);
+    } else {
+        (void)snprintf(buf, len, "%.2fs", (double)us / 1000000);
+    }
+}
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank `pct`th percentile of the sorted `values` */
+static int64_t percentile(const int64_t *values, size_t cnt, size_t pct) {
+    size_t rank = (pct * cnt + 99) / 100;
+    return values[rank == 0 ? 0 : rank - 1];
+}
+
+/* Bucket of `us`; negative values (clock skew) are counted separately */
+static unsigned int bucket(int64_t us) {
+    unsigned int b = 0;
+    while (us > 0 && b < BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+static void print_histogram(const struct stage *s) {
+    unsigned long counts[BUCKETS] = {0};
+    unsigned long negative = 0;
+    unsigned long max_count = 0;
+    unsigned int lo = BUCKETS;
+    unsigned int hi = 0;
+    for (size_t i = 0; i < s->cnt; i++) {
+        if (s->values[i] < 0) {
+            negative++;
+            continue;
+        }
+        unsigned int b = bucket(s->values[i]);
+        counts[b]++;
+        lo = b < lo ? b : lo;
+        hi = b > hi ? b : hi;
+    }
+
+    (void)printf("  %s\n", s->name);
+    if (negative != 0) {
+        (void)printf("    %22s %8lu\n", "negative", negative);
+    }
+    for (unsigned int b = lo; b <= hi && lo != BUCKETS; b++) {
+        max_count = counts[b] > max_count ? counts[b] : max_count;
+    }
+    for (unsigned int b = lo; b <= hi && lo != BUCKETS; b++) {
+        char from[32];
+        char to[32];
+        format_us(from, sizeof(from), b == 0 ? 0 : (int64_t)1 << (b - 1));
+        format_us(to, sizeof(to), (int64_t)1 << b);
+        int bar = (int)(counts[b] * BAR_WIDTH / max_count);
+        if (bar == 0 && counts[b] != 0) {
+            bar = 1;
+        }
+        (void)printf(
+            "    [%9s, %9s) %8lu%s%.*s\n",
+            from,
+            to,
+            counts[b],
+            bar == 0 ? "" : " ",
+            bar,
+            "########################################"
+        );
+    }
+}
+
+static void print_group(struct group *g) {
+    (void)printf("%s: %zu spans\n", g->name, g->spans);
+    (void)printf(
+        "  %-12s %8s %8s %10s %10s %10s %10s\n",
+        "stage",
+        "count",
+        "skew",
+        "p50",
+        "p90",
+        "p99",
+        "max"
+    );
+    for (size_t i = 0; i < g->stage_cnt; i++) {
+        struct stage *s = &g->stages[i];
+        qsort(s->values, s->cnt, sizeof(*s->values), cmp_int64);
+        /* Negative times (clock skew) sort first and are left out */
+        size_t skew = 0;
+        while (skew < s->cnt && s->values[skew] < 0) {
+            skew++;
+        }
+        const int64_t *values = s->values + skew;
+        size_t cnt = s->cnt - skew;
+        char p50[32] = "-";
+        char p90[32] = "-";
+        char p99[32] = "-";
+        char max[32] = "-";
+        if (cnt != 0) {
+            format_us(p50, sizeof(p50), percentile(values, cnt, 50));
+            format_us(p90, sizeof(p90), percentile(values, cnt, 90));
+            format_us(p99, sizeof(p99), percentile(values, cnt, 99));
+            format_us(max, sizeof(max), values[cnt - 1]);
+        }
+        (void)printf(
+            "  %-12s %8zu %8zu %10s %10s %10s %10s\n",
+            s->name,
+            s->cnt,
+            skew,
+            p50,
+            p90,
+            p99,
+            max
+        );
+    }
+    if (!quiet) {
+        for (size_t i = 0; i < g->stage_cnt; i++) {
+            print_histogram(&g->stages[i]);
+        }
+    }
+}
+
+static void free_groups(void) {
+    for (size_t i = 0; i < group_cnt; i++) {
+        for (size_t j = 0; j < groups[i].stage_cnt; j++) {
+            free(groups[i].stages[j].name);
+            free(groups[i].stages[j].values);
+        }
+        free(groups[i].stages);
+        free(groups[i].name);
+    }
+    free(groups);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+
+    while ((ch = getopt(argc, argv, "q")) != -1) {
+        switch (ch) {
+            case 'q':
+                quiet = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    int retval = EXIT_SUCCESS;
+    unsigned long malformed = 0;
+    if (argc == 0) {
+        if (read_log(stdin, "stdin", &malformed) == -1) {
+            retval = EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < argc; i++) {
+        FILE *f = fopen(argv[i], "r");
+        if (f == NULL) {
+            perror(argv[i]);
+            retval = EXIT_FAILURE;
+            continue;
+        }
+        if (read_log(f, argv[i], &malformed) == -1) {
+            retval = EXIT_FAILURE;
+        }
+        (void)fclose(f);
+    }
+    if (malformed != 0) {
+        (void)fprintf(stderr, "%lu malformed lines ignored\n", malformed);
+    }
+
+    for (size_t i = 0; i < group_cnt; i++) {
+        if (i != 0) {
+            (void)printf("\n");
+        }
+        print_group(&groups[i]);
+    }
+    free_groups();
+    return retval;
+}
@@ -0,0 +1,6 @@
+#ifndef BPMAILTRACE_H
+#define BPMAILTRACE_H
+
+#include "global.h"
+
+#endif /* BPMAILTRACE_H */
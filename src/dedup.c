@@ -0,0 +1,293 @@
+#include "dedup.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DEDUP_MAGIC 0x42504446 /* "BPDF" */
+#define DEDUP_VERSION 1
+#define FILTER_BYTES (DEDUP_FILTER_BITS / 8)
+
+struct dedup_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t filter_bits;
+    uint32_t hashes;
+    uint32_t cur; /* index of the current filter */
+    int64_t cur_start; /* when the current filter became current */
+};
+
+struct dedup {
+    int fd;
+    size_t map_len;
+    struct dedup_header *hdr;
+    unsigned char *filters[2];
+    int index_fds[2]; /* -1 without an exact index */
+    time_t window;
+    /* fcntl(2) locks do not exclude threads of the same process */
+    pthread_mutex_t lock;
+};
+
+static int lock_file(int fd, short type) {
+    struct flock fl = {0};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(fd, F_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            perror("fcntl");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void lock(struct dedup *d) {
+    pthread_mutex_lock(&d->lock);
+    (void)lock_file(d->fd, F_WRLCK);
+}
+
+static void unlock(struct dedup *d) {
+    (void)lock_file(d->fd, F_UNLCK);
+    pthread_mutex_unlock(&d->lock);
+}
+
+static void clear_filter(struct dedup *d, uint32_t i) {
+    memset(d->filters[i], 0, FILTER_BYTES);
+    if (d->index_fds[i] != -1 && ftruncate(d->index_fds[i], 0) == -1) {
+        perror("ftruncate");
+    }
+}
+
+/* Make the filters current for `now`. Called with the lock held. */
+static void rotate(struct dedup *d, time_t now) {
+    struct dedup_header *h = d->hdr;
+    time_t age = now - (time_t)h->cur_start;
+
+    if (age < 0) {
+        /*
+         * The clock went backwards. Keep what was delivered and restart the
+         * current window from now, which only makes digests last longer.
+         */
+        h->cur_start = now;
+    } else if (age >= 2 * d->window) {
+        /* Both filters are expired */
+        clear_filter(d, 0);
+        clear_filter(d, 1);
+        h->cur_start = now;
+    } else if (age >= d->window) {
+        h->cur ^= 1;
+        clear_filter(d, h->cur);
+        h->cur_start = now;
+    }
+}
+
+/* Bit `i` of the filter for `digest`, by double hashing */
+static uint64_t bit_index(const unsigned char *digest, unsigned int i) {
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    for (size_t j = 0; j < sizeof(uint64_t); j++) {
+        h1 = (h1 << 8) | digest[j];
+        h2 = (h2 << 8) | digest[j + sizeof(uint64_t)];
+    }
+    return (h1 + i * (h2 | 1)) % DEDUP_FILTER_BITS;
+}
+
+static int filter_has(
+    const unsigned char *filter,
+    const unsigned char *digest
+) {
+    for (unsigned int i = 0; i < DEDUP_HASHES; i++) {
+        uint64_t bit = bit_index(digest, i);
+        if ((filter[bit / 8] & (1U << (bit % 8))) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns 1 if `digest` is in the index file `fd`, 0 if not, -1 on failure */
+static int index_has(int fd, const unsigned char *digest) {
+    unsigned char buf[DEDUP_DIGEST_LEN * 128];
+    off_t off = 0;
+
+    for (;;) {
+        ssize_t n = pread(fd, buf, sizeof(buf), off);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("pread");
+            return -1;
+        }
+        if (n < DEDUP_DIGEST_LEN) {
+            return 0;
+        }
+        size_t records = (size_t)n / DEDUP_DIGEST_LEN;
+        for (size_t i = 0; i < records; i++) {
+            if (memcmp(buf + i * DEDUP_DIGEST_LEN, digest, DEDUP_DIGEST_LEN)
+                == 0)
+            {
+                return 1;
+            }
+        }
+        off += (off_t)(records * DEDUP_DIGEST_LEN);
+    }
+}
+
+static int open_index(const char *path, unsigned int i) {
+    char index_path[PATH_MAX];
+    if (snprintf(index_path, sizeof(index_path), "%s.%u", path, i)
+        >= (int)sizeof(index_path))
+    {
+        (void)fprintf(stderr, "duplicate index path too long\n");
+        return -1;
+    }
+    int fd = open(index_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (fd == -1) {
+        perror(index_path);
+    }
+    return fd;
+}
+
+struct dedup *dedup_open(const char *path, time_t window, int exact) {
+    struct dedup *d = calloc(1, sizeof(*d));
+    if (d == NULL) {
+        (void)fprintf(stderr, "calloc failed\n");
+        return NULL;
+    }
+    if (pthread_mutex_init(&d->lock, NULL) != 0) {
+        (void)fprintf(stderr, "pthread_mutex_init failed\n");
+        free(d);
+        return NULL;
+    }
+    d->window = window;
+    d->index_fds[0] = -1;
+    d->index_fds[1] = -1;
+    d->map_len = sizeof(struct dedup_header) + 2 * FILTER_BYTES;
+
+    d->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (d->fd == -1) {
+        perror(path);
+        dedup_close(d);
+        return NULL;
+    }
+    if (exact) {
+        for (unsigned int i = 0; i < 2; i++) {
+            d->index_fds[i] = open_index(path, i);
+            if (d->index_fds[i] == -1) {
+                dedup_close(d);
+                return NULL;
+            }
+        }
+    }
+    if (lock_file(d->fd, F_WRLCK) == -1) {
+        dedup_close(d);
+        return NULL;
+    }
+    off_t size = lseek(d->fd, 0, SEEK_END);
+    if (size != (off_t)d->map_len && ftruncate(d->fd, (off_t)d->map_len) == -1)
+    {
+        perror(path);
+        (void)lock_file(d->fd, F_UNLCK);
+        dedup_close(d);
+        return NULL;
+    }
+    void *map =
+        mmap(NULL, d->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, d->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        (void)lock_file(d->fd, F_UNLCK);
+        dedup_close(d);
+        return NULL;
+    }
+    d->hdr = map;
+    d->filters[0] = (unsigned char *)map + sizeof(struct dedup_header);
+    d->filters[1] = d->filters[0] + FILTER_BYTES;
+
+    /* Start over if the file is new or was made with other parameters */
+    struct dedup_header *h = d->hdr;
+    if (h->magic != DEDUP_MAGIC || h->version != DEDUP_VERSION
+        || h->filter_bits != DEDUP_FILTER_BITS || h->hashes != DEDUP_HASHES
+        || h->cur > 1)
+    {
+        h->magic = DEDUP_MAGIC;
+        h->version = DEDUP_VERSION;
+        h->filter_bits = DEDUP_FILTER_BITS;
+        h->hashes = DEDUP_HASHES;
+        h->cur = 0;
+        h->cur_start = time(NULL);
+        clear_filter(d, 0);
+        clear_filter(d, 1);
+    }
+    (void)lock_file(d->fd, F_UNLCK);
+    return d;
+}
+
+void dedup_close(struct dedup *d) {
+    if (d == NULL) {
+        return;
+    }
+    if (d->hdr != NULL) {
+        munmap(d->hdr, d->map_len);
+    }
+    for (unsigned int i = 0; i < 2; i++) {
+        if (d->index_fds[i] != -1) {
+            close(d->index_fds[i]);
+        }
+    }
+    if (d->fd != -1) {
+        close(d->fd);
+    }
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+}
+
+int dedup_check(
+    struct dedup *d,
+    const unsigned char digest[DEDUP_DIGEST_LEN],
+    time_t now
+) {
+    int ret = 0;
+
+    lock(d);
+    rotate(d, now);
+    for (unsigned int i = 0; i < 2 && ret == 0; i++) {
+        if (!filter_has(d->filters[i], digest)) {
+            continue;
+        }
+        ret = d->index_fds[i] == -1 ? 1 : index_has(d->index_fds[i], digest);
+    }
+    unlock(d);
+    return ret;
+}
+
+int dedup_add(
+    struct dedup *d,
+    const unsigned char digest[DEDUP_DIGEST_LEN],
+    time_t now
+) {
+    int ret = 0;
+
+    lock(d);
+    rotate(d, now);
+    uint32_t cur = d->hdr->cur;
+    for (unsigned int i = 0; i < DEDUP_HASHES; i++) {
+        uint64_t bit = bit_index(digest, i);
+        d->filters[cur][bit / 8] |= (unsigned char)(1U << (bit % 8));
+    }
+    if (d->index_fds[cur] != -1
+        && write(d->index_fds[cur], digest, DEDUP_DIGEST_LEN)
+            != DEDUP_DIGEST_LEN)
+    {
+        perror("could not add to duplicate index");
+        ret = -1;
+    }
+    unlock(d);
+    return ret;
+}
@@ -0,0 +1,59 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "global.h"
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Duplicate detection for received ADUs.
+ * Digests are remembered in a memory-mapped file holding two Bloom filters,
+ * each covering a window of time. When the current filter is older than the
+ * window, the other filter is cleared and becomes current, so a digest is
+ * remembered for between one and two windows while the file stays the same
+ * size. The file survives restarts and may be shared between processes and
+ * threads.
+ *
+ * Optionally, digests are also appended to an exact index (one file per
+ * filter) which is searched when a filter reports a possible match, so false
+ * positives never discard a message.
+ */
+
+#define DEDUP_DIGEST_LEN 32
+/* Bits in each filter; about a 1% false positive rate at 100000 digests */
+#define DEDUP_FILTER_BITS (1UL << 20)
+#define DEDUP_HASHES 7
+#define DEDUP_DEFAULT_WINDOW 86400
+
+struct dedup;
+
+/*
+ * Open or create the filter at `path`. If `exact` is set, the exact index is
+ * kept in `path`.0 and `path`.1.
+ * Returns NULL on failure. Errors are reported on stderr.
+ */
+struct dedup *dedup_open(const char *path, time_t window, int exact);
+
+void dedup_close(struct dedup *d);
+
+/*
+ * Check if `digest` was added within the last one to two windows before
+ * `now`.
+ * Returns 1 if it was (or possibly was, without an exact index), 0 if not and
+ * -1 on failure.
+ */
+int dedup_check(
+    struct dedup *d,
+    const unsigned char digest[DEDUP_DIGEST_LEN],
+    time_t now
+);
+
+/* Remember `digest`. Returns 0 on success, -1 on failure. */
+int dedup_add(
+    struct dedup *d,
+    const unsigned char digest[DEDUP_DIGEST_LEN],
+    time_t now
+);
+
+#endif /* DEDUP_H */
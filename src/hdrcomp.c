@@ -0,0 +1,999 @@
+#include "hdrcomp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+/*
+ * Encoded format:
+ *   0x00 'H' version flags varint(generation) varint(base)
+ *   varint(ack generation) varint(ack held)
+ *   field... HDR_END
+ *   body
+ * `base` is the sender's insertion count before this ADU; the fields it
+ * inserts are numbered from base + 1. Index STATIC_CNT + abs refers to dynamic
+ * entry abs of `generation`. The acknowledgment is for the table the
+ * destination node uses to send to this node.
+ */
+#define HDR_MAGIC0 0x00
+#define HDR_MAGIC1 'H'
+#define HDR_VERSION 2
+#define HDR_FLAG_CRLF 0x01
+
+/* Field representations */
+#define HDR_END 0x00
+#define HDR_INDEXED 0x01 /* varint(index) */
+#define HDR_NAME_INDEXED 0x02 /* varint(index) varint(len) value */
+#define HDR_LITERAL 0x03 /* varint(len) name varint(len) value */
+#define HDR_INSERT 0x04 /* ORed with the above to add the field to the table */
+/* Bytes from HDR_SHORT_INDEXED represent HDR_INDEXED with a small index */
+#define HDR_SHORT_INDEXED 0x10
+
+/* Table files hold STATE_MAGIC, the tables and a CRC-32 of the tables */
+#define STATE_MAGIC 0x42504832 /* "BPH2" */
+
+struct static_entry {
+    const char *name;
+    const char *value; /* NULL if only the name can be referenced */
+};
+
+/* Values include the whitespace following the colon */
+static const struct static_entry static_table[] = {
+    {"Return-Path", NULL},
+    {"Received", NULL},
+    {"DKIM-Signature", NULL},
+    {"Message-ID", NULL},
+    {"Message-Id", NULL},
+    {"Date", NULL},
+    {"From", NULL},
+    {"Sender", NULL},
+    {"Reply-To", NULL},
+    {"To", NULL},
+    {"Cc", NULL},
+    {"Subject", NULL},
+    {"In-Reply-To", NULL},
+    {"References", NULL},
+    {"MIME-Version", " 1.0"},
+    {"Mime-Version", " 1.0"},
+    {"Content-Type", " text/plain; charset=UTF-8"},
+    {"Content-Type", " text/plain; charset=\"UTF-8\""},
+    {"Content-Type", " text/plain; charset=utf-8"},
+    {"Content-Type", " text/plain; charset=\"utf-8\""},
+    {"Content-Type", " text/plain; charset=us-ascii"},
+    {"Content-Type", " text/plain; charset=\"us-ascii\""},
+    {"Content-Type", " text/plain"},
+    {"Content-Type", " text/html; charset=UTF-8"},
+    {"Content-Type", " text/html; charset=\"UTF-8\""},
+    {"Content-Transfer-Encoding", " 7bit"},
+    {"Content-Transfer-Encoding", " 8bit"},
+    {"Content-Transfer-Encoding", " quoted-printable"},
+    {"Content-Transfer-Encoding", " base64"},
+    {"Content-Disposition", " inline"},
+    {"Content-Language", " en-US"},
+    {"User-Agent", NULL},
+    {"X-Mailer", NULL},
+    {"Authentication-Results", NULL},
+    {"ARC-Seal", NULL},
+    {"ARC-Message-Signature", NULL},
+    {"ARC-Authentication-Results", NULL},
+    {"Delivered-To", NULL},
+    {"List-Id", NULL},
+    {"List-Unsubscribe", NULL},
+    {"Precedence", " bulk"},
+    {"Precedence", " list"},
+    {"Auto-Submitted", " auto-generated"},
+    {"Auto-Submitted", " auto-replied"},
+    {"X-Priority", NULL},
+    {"Importance", NULL},
+    {"Thread-Topic", NULL},
+    {"Thread-Index", NULL},
+};
+
+#define STATIC_CNT (sizeof(static_table) / sizeof(static_table[0]))
+
+/* Fields whose values are (nearly) unique to each message */
+static const char *const never_insert[] = {
+    "Received",
+    "Date",
+    "Message-ID",
+    "DKIM-Signature",
+    "ARC-Seal",
+    "ARC-Message-Signature",
+    "ARC-Authentication-Results",
+    "Authentication-Results",
+    "In-Reply-To",
+    "References",
+    "Thread-Index",
+};
+
+/* A table file locked by a thread of this process */
+struct state {
+    struct state *next;
+    int fd;
+    char path[PATH_MAX];
+};
+
+/*
+ * fcntl(2) locks do not exclude threads of the same process, and closing any
+ * descriptor of a file drops them, so threads also wait for the tables in
+ * `busy` to be released.
+ */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_released = PTHREAD_COND_INITIALIZER;
+static struct state *busy = NULL;
+
+struct hdrcomp_send {
+    struct state *st;
+    struct hdr_table table;
+};
+
+struct buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+static int buf_put(struct buf *b, const void *data, size_t len) {
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap == 0 ? 1024 : b->cap;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        char *tmp = realloc(b->data, cap);
+        if (tmp == NULL) {
+            return -1;
+        }
+        b->data = tmp;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int buf_byte(struct buf *b, unsigned char c) {
+    return buf_put(b, &c, 1);
+}
+
+static int buf_varint(struct buf *b, uint64_t v) {
+    unsigned char tmp[10];
+    size_t n = 0;
+    do {
+        tmp[n] = (unsigned char)(v & 0x7f);
+        v >>= 7;
+        if (v != 0) {
+            tmp[n] |= 0x80;
+        }
+        n++;
+    } while (v != 0);
+    return buf_put(b, tmp, n);
+}
+
+static int buf_string(struct buf *b, const char *s, size_t len) {
+    if (buf_varint(b, len) == -1) {
+        return -1;
+    }
+    return buf_put(b, s, len);
+}
+
+static int get_varint(const char *in, size_t in_len, size_t *pos, uint64_t *v) {
+    *v = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (*pos >= in_len) {
+            return -1;
+        }
+        unsigned char c = (unsigned char)in[(*pos)++];
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if ((c & 0x80) == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int get_string(
+    const char *in,
+    size_t in_len,
+    size_t *pos,
+    const char **s,
+    size_t *len
+) {
+    uint64_t v;
+    if (get_varint(in, in_len, pos, &v) == -1 || v > in_len - *pos) {
+        return -1;
+    }
+    *s = in + *pos;
+    *len = (size_t)v;
+    *pos += *len;
+    return 0;
+}
+
+static int insertable(const char *name, size_t name_len, size_t value_len) {
+    if (name_len > HDRCOMP_MAX_NAME || value_len > HDRCOMP_MAX_VALUE) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(never_insert) / sizeof(never_insert[0]);
+         i++)
+    {
+        if (strlen(never_insert[i]) == name_len
+            && strncasecmp(never_insert[i], name, name_len) == 0)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void table_insert(
+    struct hdr_table *t,
+    uint64_t abs,
+    const char *name,
+    size_t name_len,
+    const char *value,
+    size_t value_len
+) {
+    if (abs == 0 || abs > HDRCOMP_DYN_ENTRIES) {
+        return;
+    }
+    /* Entries are never replaced within a generation */
+    struct hdr_entry *e = &t->entries[abs - 1];
+    if (e->abs != 0) {
+        return;
+    }
+    e->abs = (uint32_t)abs;
+    e->adu = t->adus;
+    e->name_len = (uint16_t)name_len;
+    e->value_len = (uint16_t)value_len;
+    memcpy(e->name, name, name_len);
+    memcpy(e->value, value, value_len);
+    if (abs > t->insert_count) {
+        t->insert_count = abs;
+    }
+}
+
+/* Returns the entry with absolute index `abs`, or NULL if it is not present */
+static const struct hdr_entry *
+table_get(const struct hdr_table *t, uint64_t abs) {
+    if (t == NULL || abs == 0 || abs > HDRCOMP_DYN_ENTRIES) {
+        return NULL;
+    }
+    const struct hdr_entry *e = &t->entries[abs - 1];
+    return e->abs == abs ? e : NULL;
+}
+
+static int entry_is(
+    const struct hdr_entry *e,
+    const char *name,
+    size_t name_len,
+    const char *value,
+    size_t value_len
+) {
+    return e->name_len == name_len && e->value_len == value_len
+        && memcmp(e->name, name, name_len) == 0
+        && memcmp(e->value, value, value_len) == 0;
+}
+
+/*
+ * Look up a field in the static table and then the entries of `t` the receiver
+ * acknowledged. Sets `*full` to the index of an entry matching both name and
+ * value and `*name_only` to the index of an entry matching the name; either is
+ * 0 if there is no such entry.
+ */
+static void table_find(
+    const struct hdr_table *t,
+    const char *name,
+    size_t name_len,
+    const char *value,
+    size_t value_len,
+    uint64_t *full,
+    uint64_t *name_only
+) {
+    *full = 0;
+    *name_only = 0;
+    for (size_t i = 0; i < STATIC_CNT; i++) {
+        const struct static_entry *s = &static_table[i];
+        if (strlen(s->name) != name_len
+            || memcmp(s->name, name, name_len) != 0)
+        {
+            continue;
+        }
+        if (*name_only == 0) {
+            *name_only = i + 1;
+        }
+        if (s->value != NULL && strlen(s->value) == value_len
+            && memcmp(s->value, value, value_len) == 0)
+        {
+            *full = i + 1;
+            return;
+        }
+    }
+    for (uint64_t abs = 1; abs <= t->insert_count; abs++) {
+        const struct hdr_entry *e = table_get(t, abs);
+        if (e == NULL || (t->acked & (UINT64_C(1) << (abs - 1))) == 0
+            || e->name_len != name_len || memcmp(e->name, name, name_len) != 0)
+        {
+            continue;
+        }
+        if (*name_only == 0) {
+            *name_only = STATIC_CNT + abs;
+        }
+        if (entry_is(e, name, name_len, value, value_len)) {
+            *full = STATIC_CNT + abs;
+            return;
+        }
+    }
+}
+
+/*
+ * Returns 1 if a field with this name and value was inserted recently enough
+ * that its acknowledgment may still be on the way.
+ */
+static int recently_inserted(
+    const struct hdr_table *t,
+    const char *name,
+    size_t name_len,
+    const char *value,
+    size_t value_len
+) {
+    for (uint64_t abs = 1; abs <= t->insert_count; abs++) {
+        const struct hdr_entry *e = table_get(t, abs);
+        if (e != NULL && t->adus - e->adu < HDRCOMP_REINSERT_ADUS
+            && entry_is(e, name, name_len, value, value_len))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Resolve `index` against the static table and the entries of `t`, which is
+ * NULL if the ADU is from a generation that is no longer kept.
+ * Returns -1 if the entry is not available.
+ */
+static int resolve(
+    const struct hdr_table *t,
+    uint64_t index,
+    const char **name,
+    size_t *name_len,
+    const char **value,
+    size_t *value_len
+) {
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= STATIC_CNT) {
+        const struct static_entry *s = &static_table[index - 1];
+        *name = s->name;
+        *name_len = strlen(s->name);
+        *value = s->value;
+        *value_len = s->value == NULL ? 0 : strlen(s->value);
+        return 0;
+    }
+    const struct hdr_entry *e = table_get(t, index - STATIC_CNT);
+    if (e == NULL) {
+        return -1;
+    }
+    *name = e->name;
+    *name_len = e->name_len;
+    *value = e->value;
+    *value_len = e->value_len;
+    return 0;
+}
+
+int hdrcomp_is_encoded(const char *in, size_t in_len) {
+    return in_len >= 3 && in[0] == HDR_MAGIC0 && in[1] == HDR_MAGIC1
+        && in[2] == HDR_VERSION;
+}
+
+int hdrcomp_encode(
+    struct hdr_table *t,
+    const struct hdr_ack *ack,
+    const char *in,
+    size_t in_len,
+    char **out,
+    size_t *out_len
+) {
+    *out = NULL;
+    *out_len = 0;
+
+    /* The line ending of the first line must be used by every field */
+    const char *nl = memchr(in, '\n', in_len);
+    if (nl == NULL) {
+        return 0;
+    }
+    int crlf = nl > in && nl[-1] == '\r';
+    size_t eol_len = crlf ? 2 : 1;
+
+    /*
+     * Entries are never evicted, so a full table is replaced, but not before
+     * the receiver had a chance to acknowledge and use its entries.
+     */
+    if (t->generation == 0
+        || (t->insert_count >= HDRCOMP_DYN_ENTRIES
+            && t->adus >= HDRCOMP_GENERATION_ADUS))
+    {
+        uint32_t now = (uint32_t)time(NULL);
+        t->generation = now > t->generation ? now : t->generation + 1;
+        t->adus = 0;
+        t->insert_count = 0;
+        t->acked = 0;
+        memset(t->entries, 0, sizeof(t->entries));
+    }
+    uint64_t base = t->insert_count;
+
+    /*
+     * Encode into a scratch copy of the table so `t` is left alone if the
+     * header cannot be parsed.
+     */
+    struct hdr_table *scratch = malloc(sizeof(*scratch));
+    if (scratch == NULL) {
+        return -1;
+    }
+    memcpy(scratch, t, sizeof(*scratch));
+
+    struct buf b = {NULL, 0, 0};
+    int fail = buf_byte(&b, HDR_MAGIC0) == -1
+        || buf_byte(&b, HDR_MAGIC1) == -1 || buf_byte(&b, HDR_VERSION) == -1
+        || buf_byte(&b, crlf ? HDR_FLAG_CRLF : 0) == -1
+        || buf_varint(&b, t->generation) == -1 || buf_varint(&b, base) == -1
+        || buf_varint(&b, ack->generation) == -1
+        || buf_varint(&b, ack->held) == -1;
+
+    size_t pos = 0;
+    size_t fields = 0;
+    while (!fail) {
+        /* An empty line ends the header */
+        if (in_len - pos >= eol_len
+            && memcmp(in + pos, crlf ? "\r\n" : "\n", eol_len) == 0)
+        {
+            pos += eol_len;
+            break;
+        }
+
+        const char *name = in + pos;
+        size_t name_len = 0;
+        while (pos + name_len < in_len && name[name_len] != ':'
+               && name[name_len] > ' ' && name[name_len] < 0x7f)
+        {
+            name_len++;
+        }
+        if (pos + name_len >= in_len || name[name_len] != ':' || name_len == 0)
+        {
+            free(b.data);
+            free(scratch);
+            return 0; /* not an RFC 5322 header; send as is */
+        }
+
+        /* The value runs until a line that does not start with WSP */
+        const char *value = name + name_len + 1;
+        size_t end = (size_t)(value - in);
+        for (;;) {
+            nl = memchr(in + end, '\n', in_len - end);
+            if (nl == NULL) {
+                free(b.data);
+                free(scratch);
+                return 0;
+            }
+            end = (size_t)(nl - in) + 1;
+            if (end >= in_len || (in[end] != ' ' && in[end] != '\t')) {
+                break;
+            }
+        }
+        if (crlf != ((size_t)(nl - in) > 0 && nl[-1] == '\r')) {
+            free(b.data);
+            free(scratch);
+            return 0;
+        }
+        size_t value_len = (size_t)(nl - value) + 1 - eol_len;
+        pos = end;
+        fields++;
+
+        uint64_t full;
+        uint64_t name_only;
+        table_find(
+            scratch,
+            name,
+            name_len,
+            value,
+            value_len,
+            &full,
+            &name_only
+        );
+        if (full != 0) {
+            if (full < 0x100 - HDR_SHORT_INDEXED) {
+                fail = buf_byte(&b, (unsigned char)(HDR_SHORT_INDEXED + full))
+                    == -1;
+            } else {
+                fail = buf_byte(&b, HDR_INDEXED) == -1
+                    || buf_varint(&b, full) == -1;
+            }
+            continue;
+        }
+
+        unsigned char insert = 0;
+        if (insertable(name, name_len, value_len)
+            && scratch->insert_count < HDRCOMP_DYN_ENTRIES
+            && !recently_inserted(scratch, name, name_len, value, value_len))
+        {
+            insert = HDR_INSERT;
+            table_insert(
+                scratch,
+                scratch->insert_count + 1,
+                name,
+                name_len,
+                value,
+                value_len
+            );
+        }
+        if (name_only != 0) {
+            fail = buf_byte(&b, HDR_NAME_INDEXED | insert) == -1
+                || buf_varint(&b, name_only) == -1;
+        } else {
+            fail = buf_byte(&b, HDR_LITERAL | insert) == -1
+                || buf_string(&b, name, name_len) == -1;
+        }
+        fail = fail || buf_string(&b, value, value_len) == -1;
+    }
+
+    if (fail || buf_byte(&b, HDR_END) == -1
+        || buf_put(&b, in + pos, in_len - pos) == -1)
+    {
+        free(b.data);
+        free(scratch);
+        return -1;
+    }
+    if (fields == 0) {
+        free(b.data);
+        free(scratch);
+        return 0;
+    }
+
+    memcpy(t, scratch, sizeof(*t));
+    t->adus++;
+    free(scratch);
+    *out = b.data;
+    *out_len = b.len;
+    return 0;
+}
+
+int hdrcomp_decode(
+    struct hdr_recv_tables *t,
+    struct hdr_ack *ack,
+    const char *in,
+    size_t in_len,
+    char **out,
+    size_t *out_len
+) {
+    ack->generation = 0;
+    ack->held = 0;
+    if (!hdrcomp_is_encoded(in, in_len) || in_len < 4) {
+        return -1;
+    }
+    int crlf = (in[3] & HDR_FLAG_CRLF) != 0;
+    const char *eol = crlf ? "\r\n" : "\n";
+    size_t eol_len = crlf ? 2 : 1;
+
+    size_t pos = 4;
+    uint64_t generation;
+    uint64_t base;
+    uint64_t ack_generation;
+    uint64_t ack_held;
+    if (get_varint(in, in_len, &pos, &generation) == -1
+        || get_varint(in, in_len, &pos, &base) == -1
+        || get_varint(in, in_len, &pos, &ack_generation) == -1
+        || get_varint(in, in_len, &pos, &ack_held) == -1
+        || generation == 0 || generation > UINT32_MAX
+        || base > HDRCOMP_DYN_ENTRIES || ack_generation > UINT32_MAX)
+    {
+        return -1;
+    }
+    ack->generation = (uint32_t)ack_generation;
+    ack->held = ack_held;
+
+    /*
+     * ADUs of the previous generation may still arrive after the first ADU of
+     * a new one. Older ADUs are stale: their inserts are dropped and their
+     * references to dynamic entries can't be resolved.
+     */
+    struct hdr_table *table = NULL;
+    if (generation > t->cur.generation) {
+        memcpy(&t->prev, &t->cur, sizeof(t->prev));
+        memset(&t->cur, 0, sizeof(t->cur));
+        t->cur.generation = (uint32_t)generation;
+        table = &t->cur;
+    } else if (generation == t->cur.generation) {
+        table = &t->cur;
+    } else if (generation == t->prev.generation) {
+        table = &t->prev;
+    }
+
+    struct buf b = {NULL, 0, 0};
+    uint64_t next_insert = base + 1;
+    int missing = 0;
+    for (;;) {
+        if (pos >= in_len) {
+            free(b.data);
+            return -1;
+        }
+        unsigned char op = (unsigned char)in[pos++];
+        if (op == HDR_END) {
+            break;
+        }
+
+        const char *name;
+        size_t name_len;
+        const char *value;
+        size_t value_len;
+        uint64_t index;
+        if (op >= HDR_SHORT_INDEXED || op == HDR_INDEXED) {
+            if (op >= HDR_SHORT_INDEXED) {
+                index = op - HDR_SHORT_INDEXED;
+            } else if (get_varint(in, in_len, &pos, &index) == -1) {
+                free(b.data);
+                return -1;
+            }
+            if (resolve(table, index, &name, &name_len, &value, &value_len)
+                    == -1
+                || value == NULL)
+            {
+                missing = 1;
+                continue;
+            }
+        } else {
+            int name_ok = 1;
+            switch (op & ~HDR_INSERT) {
+                case HDR_NAME_INDEXED: {
+                    const char *ignored;
+                    size_t ignored_len;
+                    if (get_varint(in, in_len, &pos, &index) == -1) {
+                        free(b.data);
+                        return -1;
+                    }
+                    name_ok = resolve(
+                                  table,
+                                  index,
+                                  &name,
+                                  &name_len,
+                                  &ignored,
+                                  &ignored_len
+                              )
+                        == 0;
+                    break;
+                }
+                case HDR_LITERAL:
+                    if (get_string(in, in_len, &pos, &name, &name_len) == -1) {
+                        free(b.data);
+                        return -1;
+                    }
+                    break;
+                default:
+                    free(b.data);
+                    return -1;
+            }
+            if (get_string(in, in_len, &pos, &value, &value_len) == -1) {
+                free(b.data);
+                return -1;
+            }
+            if (!name_ok) {
+                missing = 1;
+                if (op & HDR_INSERT) {
+                    next_insert++;
+                }
+                continue;
+            }
+            if (op & HDR_INSERT) {
+                if (table != NULL && next_insert >= 1
+                    && next_insert <= HDRCOMP_DYN_ENTRIES
+                    && name_len <= HDRCOMP_MAX_NAME
+                    && value_len <= HDRCOMP_MAX_VALUE)
+                {
+                    table_insert(
+                        table,
+                        next_insert,
+                        name,
+                        name_len,
+                        value,
+                        value_len
+                    );
+                }
+                next_insert++;
+            }
+        }
+
+        if (buf_put(&b, name, name_len) == -1 || buf_byte(&b, ':') == -1
+            || buf_put(&b, value, value_len) == -1
+            || buf_put(&b, eol, eol_len) == -1)
+        {
+            free(b.data);
+            return -1;
+        }
+    }
+
+    if (missing) {
+        (void)fprintf(stderr, "header table out of sync\n");
+        free(b.data);
+        return -1;
+    }
+    if (buf_put(&b, eol, eol_len) == -1
+        || buf_put(&b, in + pos, in_len - pos) == -1)
+    {
+        free(b.data);
+        return -1;
+    }
+    *out = b.data;
+    *out_len = b.len;
+    return 0;
+}
+
+/* Returns the bitmap of the entries present in `t` */
+static uint64_t table_held(const struct hdr_table *t) {
+    uint64_t held = 0;
+    for (uint64_t abs = 1; abs <= HDRCOMP_DYN_ENTRIES; abs++) {
+        if (table_get(t, abs) != NULL) {
+            held |= UINT64_C(1) << (abs - 1);
+        }
+    }
+    return held;
+}
+
+void hdrcomp_ack(const struct hdr_recv_tables *t, struct hdr_ack *ack) {
+    ack->generation = t->cur.generation;
+    ack->held = table_held(&t->cur);
+}
+
+void hdrcomp_acked(struct hdr_table *t, const struct hdr_ack *ack) {
+    /*
+     * Acknowledgments of other generations are of no use. A late one may
+     * acknowledge fewer entries, which only costs compression.
+     */
+    if (ack->generation != 0 && ack->generation == t->generation) {
+        t->acked = ack->held & table_held(t);
+    }
+}
+
+static uint32_t state_crc(const void *t, size_t size) {
+    return (uint32_t)crc32(crc32(0, NULL, 0), t, (uInt)size);
+}
+
+static void state_release(struct state *st) {
+    pthread_mutex_lock(&state_lock);
+    for (struct state **p = &busy; *p != NULL; p = &(*p)->next) {
+        if (*p == st) {
+            *p = st->next;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&state_released);
+    pthread_mutex_unlock(&state_lock);
+    free(st);
+}
+
+/*
+ * Open and lock the tables of the node of `eid` in `state_dir`, reading `size`
+ * bytes into `t`. Missing or unreadable tables are replaced by empty ones.
+ * Returns the table file to pass to state_close(), or NULL on failure.
+ */
+static struct state *state_open(
+    const char *state_dir,
+    const char *prefix,
+    const char *eid,
+    void *t,
+    size_t size
+) {
+    if (strncmp("ipn:", eid, 4) != 0) {
+        (void)fprintf(stderr, "header compression requires an ipn EID\n");
+        return NULL;
+    }
+    errno = 0;
+    char *endptr;
+    unsigned long long node_nbr = strtoull(eid + 4, &endptr, 0);
+    if (eid + 4 == endptr || errno != 0) {
+        (void)fprintf(stderr, "invalid EID: %s\n", eid);
+        return NULL;
+    }
+
+    struct state *st = malloc(sizeof(*st));
+    if (st == NULL) {
+        return NULL;
+    }
+    if (snprintf(
+            st->path,
+            sizeof(st->path),
+            "%s/%s-%llu",
+            state_dir,
+            prefix,
+            node_nbr
+        )
+        >= (int)sizeof(st->path))
+    {
+        (void)fprintf(stderr, "header table path too long\n");
+        free(st);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&state_lock);
+    for (const struct state *b = busy; b != NULL;) {
+        if (strcmp(b->path, st->path) == 0) {
+            pthread_cond_wait(&state_released, &state_lock);
+            b = busy;
+        } else {
+            b = b->next;
+        }
+    }
+    st->next = busy;
+    busy = st;
+    pthread_mutex_unlock(&state_lock);
+
+    st->fd = open(st->path, O_RDWR | O_CREAT, 0600);
+    if (st->fd == -1) {
+        perror(st->path);
+        state_release(st);
+        return NULL;
+    }
+    struct flock fl = {0};
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    while (fcntl(st->fd, F_SETLKW, &fl) == -1) {
+        if (errno != EINTR) {
+            perror(st->path);
+            close(st->fd);
+            state_release(st);
+            return NULL;
+        }
+    }
+
+    uint32_t magic = 0;
+    uint32_t crc = 0;
+    if (pread(st->fd, &magic, sizeof(magic), 0) != (ssize_t)sizeof(magic)
+        || magic != STATE_MAGIC
+        || pread(st->fd, t, size, sizeof(magic)) != (ssize_t)size
+        || pread(st->fd, &crc, sizeof(crc), (off_t)(sizeof(magic) + size))
+            != (ssize_t)sizeof(crc)
+        || crc != state_crc(t, size))
+    {
+        memset(t, 0, size);
+    }
+    return st;
+}
+
+/* Write `t` back unless it is NULL, then unlock the table file */
+static void state_close(struct state *st, const void *t, size_t size) {
+    uint32_t magic = STATE_MAGIC;
+    /*
+     * The table is overwritten in place, so a crash may leave a mix of the
+     * old and new tables. The CRC no longer matches, and the next
+     * state_open() starts over with an empty table rather than one whose
+     * entries differ from those of the peer.
+     */
+    uint32_t crc = t == NULL ? 0 : state_crc(t, size);
+    if (t != NULL
+        && (pwrite(st->fd, &magic, sizeof(magic), 0) != (ssize_t)sizeof(magic)
+            || pwrite(st->fd, t, size, sizeof(magic)) != (ssize_t)size
+            || pwrite(st->fd, &crc, sizeof(crc), (off_t)(sizeof(magic) + size))
+                != (ssize_t)sizeof(crc)))
+    {
+        perror("could not save header table");
+    }
+    /* Closed before another thread may open it and take the lock */
+    close(st->fd);
+    state_release(st);
+}
+
+struct hdrcomp_send *hdrcomp_send_begin(
+    const char *state_dir,
+    const char *dest_eid,
+    const char *in,
+    size_t in_len,
+    char **out,
+    size_t *out_len
+) {
+    struct hdrcomp_send *s = malloc(sizeof(*s));
+    struct hdr_recv_tables *r = malloc(sizeof(*r));
+    if (s == NULL || r == NULL) {
+        free(s);
+        free(r);
+        return NULL;
+    }
+
+    /*
+     * The tables are locked one after the other, never together, so no lock
+     * order is needed between threads or processes.
+     */
+    struct hdr_ack ack;
+    struct state *st = state_open(state_dir, "recv", dest_eid, r, sizeof(*r));
+    if (st == NULL) {
+        free(s);
+        free(r);
+        return NULL;
+    }
+    hdrcomp_ack(r, &ack);
+    state_close(st, NULL, 0);
+    free(r);
+
+    /* Only the table of `dest_eid` stays locked until the ADU is sent */
+    s->st = state_open(
+        state_dir,
+        "send",
+        dest_eid,
+        &s->table,
+        sizeof(s->table)
+    );
+    if (s->st == NULL) {
+        free(s);
+        return NULL;
+    }
+    if (hdrcomp_encode(&s->table, &ack, in, in_len, out, out_len) == -1) {
+        state_close(s->st, NULL, 0);
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void hdrcomp_send_end(struct hdrcomp_send *s, int sent) {
+    if (s == NULL) {
+        return;
+    }
+    /*
+     * The receiver never sees the inserts of an ADU that was not sent, so
+     * later ADUs must not refer to them.
+     */
+    if (sent) {
+        state_close(s->st, &s->table, sizeof(s->table));
+    } else {
+        state_close(s->st, NULL, 0);
+    }
+    free(s);
+}
+
+int hdrcomp_recv(
+    const char *state_dir,
+    const char *src_eid,
+    const char *in,
+    size_t in_len,
+    char **out,
+    size_t *out_len
+) {
+    struct hdr_recv_tables *t = calloc(1, sizeof(*t));
+    if (t == NULL) {
+        return -1;
+    }
+    struct hdr_ack ack;
+    if (state_dir == NULL) {
+        int ret = hdrcomp_decode(t, &ack, in, in_len, out, out_len);
+        free(t);
+        return ret;
+    }
+
+    struct state *st = state_open(state_dir, "recv", src_eid, t, sizeof(*t));
+    if (st == NULL) {
+        free(t);
+        return -1;
+    }
+    int ret = hdrcomp_decode(t, &ack, in, in_len, out, out_len);
+    state_close(st, t, sizeof(*t));
+    free(t);
+
+    /* The acknowledgment is for the table used to send to `src_eid` */
+    if (ack.generation != 0) {
+        struct hdr_table *send = malloc(sizeof(*send));
+        if (send != NULL) {
+            st = state_open(state_dir, "send", src_eid, send, sizeof(*send));
+            if (st != NULL) {
+                hdrcomp_acked(send, &ack);
+                state_close(st, send, sizeof(*send));
+            }
+            free(send);
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,146 @@
+#ifndef HDRCOMP_H
+#define HDRCOMP_H
+
+#include "global.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Header compression for RFC 5322 messages, in the spirit of HPACK (RFC 7541).
+ * Header fields are replaced with references to a static table of common
+ * fields and to a dynamic table of fields previously sent to the same node.
+ * The body is left untouched; the result is deflated like any other ADU.
+ *
+ * ADUs may be lost or arrive in any order, so the sender only refers to
+ * dynamic entries that the receiver acknowledged holding. Every ADU carries
+ * an acknowledgment of the entries its sending node holds of the destination
+ * node's table, so entries are acknowledged whenever mail flows both ways
+ * between two nodes; on a one-way link, only the static table is referenced.
+ *
+ * Within a generation, entries are numbered by insertion and only ever
+ * appended, so an acknowledged entry stays available whatever ADUs arrive
+ * later. Once its table is full, the sender starts a new generation after at
+ * least HDRCOMP_GENERATION_ADUS ADUs. Receivers keep the table of the previous
+ * generation, so ADUs sent before a new generation started still decode.
+ */
+
+#define HDRCOMP_DYN_ENTRIES 64
+#define HDRCOMP_MAX_NAME 76
+#define HDRCOMP_MAX_VALUE 512
+#define HDRCOMP_GENERATION_ADUS 32
+/* ADUs after which an entry that was not acknowledged is inserted again */
+#define HDRCOMP_REINSERT_ADUS 8
+
+struct hdr_entry {
+    uint32_t abs; /* 1 to HDRCOMP_DYN_ENTRIES, or 0 if the slot is empty */
+    uint32_t adu; /* ADU of the generation that inserted it (sender only) */
+    uint16_t name_len;
+    uint16_t value_len;
+    char name[HDRCOMP_MAX_NAME];
+    char value[HDRCOMP_MAX_VALUE];
+};
+
+struct hdr_table {
+    uint32_t generation;
+    uint32_t adus; /* ADUs encoded in this generation (sender only) */
+    uint64_t insert_count;
+    /* Entries the receiver holds, bit abs - 1 for entry abs (sender only) */
+    uint64_t acked;
+    struct hdr_entry entries[HDRCOMP_DYN_ENTRIES];
+};
+
+/* Tables of the current and previous generations of a sending node */
+struct hdr_recv_tables {
+    struct hdr_table cur;
+    struct hdr_table prev;
+};
+
+/* Entries of a generation of the peer's table held by the receiver */
+struct hdr_ack {
+    uint32_t generation; /* 0 if nothing is held */
+    uint64_t held; /* bit abs - 1 for entry abs */
+};
+
+/* Returns 1 if `in` was produced by hdrcomp_encode(), 0 otherwise */
+int hdrcomp_is_encoded(const char *in, size_t in_len);
+
+/*
+ * Encode the header of `in` with the sender table `t`, updating `t`, and
+ * attach `ack` for the destination.
+ * On success, `*out` points to `*out_len` bytes allocated by malloc(), or is
+ * NULL if the header could not be parsed and `in` should be sent as is.
+ * Returns 0 on success, -1 on failure.
+ */
+int hdrcomp_encode(
+    struct hdr_table *t,
+    const struct hdr_ack *ack,
+    const char *in,
+    size_t in_len,
+    char **out,
+    size_t *out_len
+);
+
+/*
+ * Decode `in` with the receiver tables `t`, updating `t`, and set `*ack` to the
+ * acknowledgment it carried for the sender table of this node.
+ * On success, `*out` points to `*out_len` bytes allocated by malloc().
+ * Returns 0 on success, -1 on failure (including references to dynamic table
+ * entries that `t` does not have).
+ */
+int hdrcomp_decode(
+    struct hdr_recv_tables *t,
+    struct hdr_ack *ack,
+    const char *in,
+    size_t in_len,
+    char **out,
+    size_t *out_len
+);
+
+/* Set `ack` to the entries held in `t`, for the node that sent them */
+void hdrcomp_ack(const struct hdr_recv_tables *t, struct hdr_ack *ack);
+
+/* Record that the receiver of `t` holds the entries in `ack` */
+void hdrcomp_acked(struct hdr_table *t, const struct hdr_ack *ack);
+
+/* Sender table held from encoding an ADU until it is known to be sent */
+struct hdrcomp_send;
+
+/*
+ * hdrcomp_encode() with the table for the node of `dest_eid` stored in
+ * `state_dir`, acknowledging the entries of the receiving tables for that
+ * node. The table stays locked until hdrcomp_send_end(), so ADUs to a node are
+ * sent in the order they were encoded, and tables may be shared between
+ * processes and threads.
+ * Returns NULL on failure.
+ */
+struct hdrcomp_send *hdrcomp_send_begin(
+    const char *state_dir,
+    const char *dest_eid,
+    const char *in,
+    size_t in_len,
+    char **out,
+    size_t *out_len
+);
+
+/*
+ * Save the table updated by hdrcomp_send_begin() if the ADU was `sent`, then
+ * unlock it. Does nothing if `s` is NULL.
+ */
+void hdrcomp_send_end(struct hdrcomp_send *s, int sent);
+
+/*
+ * hdrcomp_decode() with the tables for the node of `src_eid` stored in
+ * `state_dir`, recording the acknowledgment in the sending table for that
+ * node. If `state_dir` is NULL, only the static table is available.
+ */
+int hdrcomp_recv(
+    const char *state_dir,
+    const char *src_eid,
+    const char *in,
+    size_t in_len,
+    char **out,
+    size_t *out_len
+);
+
+#endif /* HDRCOMP_H */
@@ -0,0 +1,356 @@
+#ifdef HAVE_SYNCFS
+#define _GNU_SOURCE /* syncfs(2) is a Linux extension */
+#endif
+
+#include "maildir.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NAME_LEN 128
+
+struct pending {
+    int fd; /* open until the file is synced */
+    char name[NAME_LEN];
+    int ok;
+    maildir_committed_cb *committed;
+    void *arg;
+};
+
+struct maildir {
+    int tmp_fd;
+    int new_fd;
+    unsigned int window_ms;
+    int use_syncfs;
+    char hostname[64];
+    unsigned long seq;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t added; /* a message was added or the Maildir is closing */
+    pthread_cond_t space; /* the queue has room */
+    struct pending queue[MAILDIR_MAX_PENDING];
+    size_t queued;
+    struct timespec first_added; /* CLOCK_MONOTONIC */
+    int closing;
+    /* Only used by the commit thread */
+    struct pending batch[MAILDIR_MAX_PENDING];
+};
+
+static int timespec_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec
+        || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Returns 1 if syncfs(2) reports writeback errors, which Linux only does since
+ * 5.8. Before that, a message whose data failed to be written would be
+ * committed.
+ */
+static int syncfs_reports_errors(void) {
+#ifdef HAVE_SYNCFS
+    struct utsname u;
+    unsigned int major;
+    unsigned int minor;
+    if (uname(&u) == -1 || sscanf(u.release, "%u.%u", &major, &minor) != 2) {
+        return 0;
+    }
+    return major > 5 || (major == 5 && minor >= 8);
+#else
+    return 0;
+#endif
+}
+
+/* Make the files of the `n` messages of the batch durable */
+static void sync_files(struct maildir *md, size_t n) {
+    struct pending *batch = md->batch;
+
+#ifdef HAVE_SYNCFS
+    /* One sync of the file system covers every file in the batch */
+    if (md->use_syncfs) {
+        int ok = syncfs(md->tmp_fd) == 0;
+        if (!ok) {
+            perror("could not sync messages");
+        }
+        for (size_t i = 0; i < n; i++) {
+            batch[i].ok = ok;
+            (void)close(batch[i].fd);
+        }
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) {
+        batch[i].ok = 1;
+        if (fsync(batch[i].fd) == -1) {
+            perror("could not sync message");
+            batch[i].ok = 0;
+        }
+        (void)close(batch[i].fd);
+    }
+}
+
+/* Make the `n` messages of the batch durable and report them */
+static void commit(struct maildir *md, size_t n) {
+    struct pending *batch = md->batch;
+    int renamed = 0;
+
+    /*
+     * Files are synced before they are renamed, so new/ never holds a message
+     * that is not complete on disk.
+     */
+    sync_files(md, n);
+    for (size_t i = 0; i < n; i++) {
+        if (batch[i].ok
+            && renameat(md->tmp_fd, batch[i].name, md->new_fd, batch[i].name)
+                == -1)
+        {
+            perror("could not move message into new");
+            batch[i].ok = 0;
+        }
+        if (batch[i].ok) {
+            renamed = 1;
+        } else {
+            (void)unlinkat(md->tmp_fd, batch[i].name, 0);
+        }
+    }
+    /* One sync of the directory covers every rename in the batch */
+    if (renamed && fsync(md->new_fd) == -1) {
+        perror("could not sync new");
+        for (size_t i = 0; i < n; i++) {
+            batch[i].ok = 0;
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        batch[i].committed(batch[i].arg, batch[i].ok);
+    }
+}
+
+static void *commit_loop(void *arg) {
+    struct maildir *md = arg;
+
+    pthread_mutex_lock(&md->lock);
+    for (;;) {
+        while (md->queued == 0 && !md->closing) {
+            pthread_cond_wait(&md->added, &md->lock);
+        }
+        if (md->queued == 0) {
+            break;
+        }
+
+        /* Let more messages join the group until the window closes */
+        struct timespec deadline = md->first_added;
+        deadline.tv_sec += md->window_ms / 1000;
+        deadline.tv_nsec += (long)(md->window_ms % 1000) * 1000000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        for (;;) {
+            struct timespec now;
+            (void)clock_gettime(CLOCK_MONOTONIC, &now);
+            if (md->closing || md->queued == MAILDIR_MAX_PENDING
+                || !timespec_before(&now, &deadline))
+            {
+                break;
+            }
+            (void)pthread_cond_timedwait(&md->added, &md->lock, &deadline);
+        }
+
+        size_t n = md->queued;
+        memcpy(md->batch, md->queue, n * sizeof(*md->queue));
+        md->queued = 0;
+        pthread_cond_broadcast(&md->space);
+        pthread_mutex_unlock(&md->lock);
+
+        commit(md, n);
+
+        pthread_mutex_lock(&md->lock);
+    }
+    pthread_mutex_unlock(&md->lock);
+    return NULL;
+}
+
+/* Open `dir` under `path`, creating it if needed */
+static int open_dir(const char *path, const char *dir) {
+    char dir_path[PATH_MAX];
+    if (snprintf(dir_path, sizeof(dir_path), "%s/%s", path, dir)
+        >= (int)sizeof(dir_path))
+    {
+        (void)fprintf(stderr, "Maildir path too long\n");
+        return -1;
+    }
+    if (mkdir(dir_path, 0700) == -1 && errno != EEXIST) {
+        perror(dir_path);
+        return -1;
+    }
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        perror(dir_path);
+    }
+    return fd;
+}
+
+struct maildir *maildir_open(const char *path, unsigned int window_ms) {
+    struct maildir *md = calloc(1, sizeof(*md));
+    if (md == NULL) {
+        (void)fprintf(stderr, "calloc failed\n");
+        return NULL;
+    }
+    md->window_ms = window_ms;
+    md->use_syncfs = syncfs_reports_errors();
+
+    if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+        perror(path);
+        free(md);
+        return NULL;
+    }
+    md->tmp_fd = open_dir(path, "tmp");
+    md->new_fd = open_dir(path, "new");
+    int cur_fd = open_dir(path, "cur");
+    if (md->tmp_fd == -1 || md->new_fd == -1 || cur_fd == -1) {
+        int fds[] = {md->tmp_fd, md->new_fd, cur_fd};
+        for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+            if (fds[i] != -1) {
+                (void)close(fds[i]);
+            }
+        }
+        free(md);
+        return NULL;
+    }
+    (void)close(cur_fd);
+
+    /* Maildir names end with the host name, without '/' or ':' */
+    if (gethostname(md->hostname, sizeof(md->hostname)) == -1) {
+        (void)strcpy(md->hostname, "localhost");
+    }
+    md->hostname[sizeof(md->hostname) - 1] = '\0';
+    for (char *p = md->hostname; *p != '\0'; p++) {
+        if (*p == '/' || *p == ':') {
+            *p = '_';
+        }
+    }
+
+    pthread_condattr_t attr;
+    pthread_mutex_init(&md->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&md->added, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&md->space, NULL);
+
+    int err = pthread_create(&md->thread, NULL, &commit_loop, md);
+    if (err != 0) {
+        (void)fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        pthread_cond_destroy(&md->space);
+        pthread_cond_destroy(&md->added);
+        pthread_mutex_destroy(&md->lock);
+        (void)close(md->tmp_fd);
+        (void)close(md->new_fd);
+        free(md);
+        return NULL;
+    }
+    return md;
+}
+
+void maildir_close(struct maildir *md) {
+    if (md == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&md->lock);
+    md->closing = 1;
+    pthread_cond_broadcast(&md->added);
+    pthread_cond_broadcast(&md->space);
+    pthread_mutex_unlock(&md->lock);
+    pthread_join(md->thread, NULL);
+
+    pthread_cond_destroy(&md->space);
+    pthread_cond_destroy(&md->added);
+    pthread_mutex_destroy(&md->lock);
+    (void)close(md->tmp_fd);
+    (void)close(md->new_fd);
+    free(md);
+}
+
+/* Write all of `data` to `fd` */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int maildir_add(
+    struct maildir *md,
+    const char *data,
+    size_t len,
+    maildir_committed_cb *committed,
+    void *arg
+) {
+    struct pending p = {0};
+    p.committed = committed;
+    p.arg = arg;
+
+    struct timespec now;
+    (void)clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_lock(&md->lock);
+    unsigned long seq = md->seq++;
+    pthread_mutex_unlock(&md->lock);
+    (void)snprintf(
+        p.name,
+        sizeof(p.name),
+        "%lld.M%ldP%ldQ%lu.%s",
+        (long long)now.tv_sec,
+        now.tv_nsec / 1000,
+        (long)getpid(),
+        seq,
+        md->hostname
+    );
+
+    p.fd = openat(
+        md->tmp_fd,
+        p.name,
+        O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+        0600
+    );
+    if (p.fd == -1) {
+        perror("could not create message in tmp");
+        return -1;
+    }
+    if (write_all(p.fd, data, len) == -1) {
+        perror("could not write message");
+        (void)close(p.fd);
+        (void)unlinkat(md->tmp_fd, p.name, 0);
+        return -1;
+    }
+
+    pthread_mutex_lock(&md->lock);
+    while (md->queued == MAILDIR_MAX_PENDING && !md->closing) {
+        pthread_cond_wait(&md->space, &md->lock);
+    }
+    if (md->closing) {
+        pthread_mutex_unlock(&md->lock);
+        (void)close(p.fd);
+        (void)unlinkat(md->tmp_fd, p.name, 0);
+        return -1;
+    }
+    if (md->queued == 0) {
+        (void)clock_gettime(CLOCK_MONOTONIC, &md->first_added);
+    }
+    md->queue[md->queued++] = p;
+    pthread_cond_signal(&md->added);
+    pthread_mutex_unlock(&md->lock);
+    return 0;
+}
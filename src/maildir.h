@@ -0,0 +1,54 @@
+#ifndef MAILDIR_H
+#define MAILDIR_H
+
+#include "global.h"
+
+#include <stddef.h>
+
+/*
+ * Maildir delivery with group commit.
+ * Messages are written to files in tmp/ right away. A commit thread then makes
+ * every message added within a short window durable together: the files are
+ * synced with a single syncfs() where it reports write errors (or one fsync()
+ * each elsewhere), renamed into new/, and new/ is fsync()ed once for the whole
+ * group. A message is only reported as committed once the fsync() of new/ has
+ * returned; from then on it survives a crash.
+ */
+
+#define MAILDIR_DEFAULT_WINDOW_MS 10
+/* Messages written but not yet committed; maildir_add() blocks beyond this */
+#define MAILDIR_MAX_PENDING 256
+
+/*
+ * Called on the commit thread once the message is committed (`ok` is 1) or
+ * could not be committed (`ok` is 0).
+ */
+typedef void maildir_committed_cb(void *arg, int ok);
+
+struct maildir;
+
+/*
+ * Open the Maildir at `path`, creating it and its tmp/, new/ and cur/
+ * directories if needed, and start its commit thread. Messages are committed
+ * at most `window_ms` milliseconds after they are added.
+ * Returns NULL on failure. Errors are reported on stderr.
+ */
+struct maildir *maildir_open(const char *path, unsigned int window_ms);
+
+/* Commit the messages still pending, then stop the commit thread */
+void maildir_close(struct maildir *md);
+
+/*
+ * Write `data` to a new file in tmp/ and queue it for the next commit, after
+ * which `committed` is called with `arg`. May be called from several threads.
+ * Returns 0 on success. On failure, returns -1 without calling `committed`.
+ */
+int maildir_add(
+    struct maildir *md,
+    const char *data,
+    size_t len,
+    maildir_committed_cb *committed,
+    void *arg
+);
+
+#endif /* MAILDIR_H */
@@ -0,0 +1,541 @@
+#include "mailrecv.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bp.h"
+#include "gmime/gmime.h"
+#include "hdrcomp.h"
+#include "pdeflate.h"
+#include "zlib.h"
+
+struct ipn_verify {
+    unsigned long long node_nbr;
+    int success;
+    /*
+     * The callback runs on the channel's event thread. Wait on `cond` rather
+     * than on the channel's queue so that threads sharing a channel do not
+     * wait on each other's queries.
+     */
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*
+ * Decompress zlib data dynamically using the inflate API.
+ * On success, returns a Bytef * pointing to data allocated by malloc(). The
+ * caller is responsible for calling free().
+ * Returns NULL on failure.
+ */
+static Bytef *inflate_dynamic(const Bytef *in, size_t in_len, size_t *out_len) {
+    int ret;
+    z_stream strm;
+    Bytef *out = NULL;
+    size_t out_capacity = 16384; /* Start with 16KB */
+    size_t out_size = 0;
+
+    out = malloc(out_capacity);
+    if (out == NULL) {
+        return NULL;
+    }
+
+    memset(&strm, 0, sizeof(strm));
+
+    /* zlib only accepts uInt for avail_in, so we must check and cast safely */
+    if (in_len > UINT_MAX) {
+        free(out);
+        return NULL; /* input too large for zlib */
+    }
+
+    strm.next_in = (Bytef *)(uintptr_t)in; /* safe cast from const */
+    strm.avail_in = (uInt)in_len;
+
+    if (inflateInit(&strm) != Z_OK) {
+        free(out);
+        return NULL;
+    }
+
+    do {
+        size_t remaining = out_capacity - out_size;
+
+        /* zlib requires avail_out to be uInt */
+        if (remaining > UINT_MAX) {
+            inflateEnd(&strm);
+            free(out);
+            return NULL; /* chunk too big for zlib */
+        }
+
+        strm.avail_out = (uInt)remaining;
+        strm.next_out = out + out_size;
+
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR)
+        {
+            inflateEnd(&strm);
+            free(out);
+            return NULL;
+        }
+
+        out_size = strm.total_out;
+
+        /* If output buffer is full, grow it */
+        if (ret != Z_STREAM_END && strm.avail_out == 0) {
+            out_capacity *= 2;
+            Bytef *tmp = realloc(out, out_capacity);
+            if (tmp == NULL) {
+                inflateEnd(&strm);
+                free(out);
+                return NULL;
+            }
+            out = tmp;
+        }
+    } while (ret != Z_STREAM_END);
+
+    *out_len = out_size;
+
+    inflateEnd(&strm);
+    return out;
+}
+
+static void ipn_verify_done(struct ipn_verify *res) {
+    pthread_mutex_lock(&res->lock);
+    res->done = 1;
+    pthread_cond_signal(&res->cond);
+    pthread_mutex_unlock(&res->lock);
+}
+
+static void dnsrec_cb(
+    void *arg,
+    ares_status_t status,
+    size_t timeouts,
+    const ares_dns_record_t *dnsrec
+) {
+    (void)timeouts;
+    struct ipn_verify *res = arg;
+
+    if (dnsrec == NULL || status != ARES_SUCCESS) {
+        ipn_verify_done(res);
+        return;
+    }
+
+    res->success = 0;
+    size_t rr_cnt = ares_dns_record_rr_cnt(dnsrec, ARES_SECTION_ANSWER);
+    for (size_t i = 0; i < rr_cnt; i++) {
+        const ares_dns_rr_t *rr =
+            ares_dns_record_rr_get_const(dnsrec, ARES_SECTION_ANSWER, i);
+        if (rr == NULL) {
+            (void)fprintf(stderr, "ares_dns_record_rr_get_const: misuse\n");
+            break;
+        }
+
+        if (ares_dns_rr_get_type(rr) != ARES_REC_TYPE_RAW_RR) {
+            continue;
+        }
+
+        size_t len; /* TODO: do we need to keep track of len? */
+        const unsigned char *data =
+            ares_dns_rr_get_bin(rr, ARES_RR_RAW_RR_DATA, &len);
+        uint64_t r_node_nbr = 0;
+        /* data is big endian */
+        for (size_t j = 0; j < sizeof(uint64_t); j++) {
+            r_node_nbr = (r_node_nbr << 8) | data[j];
+        }
+        if (res->node_nbr == r_node_nbr) {
+            res->success = 1;
+            break;
+        }
+    }
+    ipn_verify_done(res);
+}
+
+/*
+ * Query the IPN records of `domain` and check if any of them hold `node_nbr`.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int query_ipn(
+    ares_channel_t *channel,
+    const char *domain,
+    unsigned long long node_nbr
+) {
+    struct ipn_verify res = {
+        node_nbr,
+        0,
+        0,
+        PTHREAD_MUTEX_INITIALIZER,
+        PTHREAD_COND_INITIALIZER,
+    };
+
+    /* Perform query */
+    ares_status_t status = ares_query_dnsrec(
+        channel,
+        domain,
+        ARES_CLASS_IN,
+        264, /* IPN RRTYPE value */
+        dnsrec_cb,
+        &res,
+        NULL
+    );
+    if (status != ARES_SUCCESS) {
+        (void)fprintf(
+            stderr,
+            "failed to enqueue query: %s\n",
+            ares_strerror((int)status)
+        );
+        return EXIT_FAILURE;
+    }
+
+    /* Wait until the callback for our query has run */
+    pthread_mutex_lock(&res.lock);
+    while (!res.done) {
+        pthread_cond_wait(&res.cond, &res.lock);
+    }
+    pthread_mutex_unlock(&res.lock);
+    pthread_mutex_destroy(&res.lock);
+    pthread_cond_destroy(&res.cond);
+
+    if (!res.success) {
+        (void)fprintf(stderr, "IPN verification failed\n");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Check that the domain of every RFC5322.From address has an IPN record with
+ * the node number of `src_eid`.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE.
+ */
+static int verify_source(
+    ares_channel_t *channel,
+    const char *src_eid,
+    GMimeMessage *message
+) {
+    /* Parse source EID */
+    if (strncmp("ipn:", src_eid, 4)) {
+        (void)fprintf(stderr, "source EID does not use ipn URI scheme\n");
+        return EXIT_FAILURE;
+    }
+    char *node_nbr_str = malloc(strlen(src_eid) - 4 + 1);
+    if (node_nbr_str == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    *node_nbr_str = '\0';
+    const char *start = src_eid + 4;
+    strncat(node_nbr_str, start, strcspn(start, "."));
+    errno = 0;
+    char *endptr;
+    unsigned long long node_nbr = strtoull(node_nbr_str, &endptr, 0);
+    if (node_nbr_str == endptr) {
+        errno = EINVAL;
+    }
+    if (errno != 0) {
+        perror("strtoull");
+        free(node_nbr_str);
+        return EXIT_FAILURE;
+    }
+    free(node_nbr_str);
+
+    InternetAddressList *list = g_mime_message_get_from(message);
+    if (list == NULL) {
+        (void)fprintf(
+            stderr,
+            "could not extract mailbox-list from RFC5322.From header\n"
+        );
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < internet_address_list_length(list); i++) {
+        InternetAddressMailbox *mb = (InternetAddressMailbox *)
+            internet_address_list_get_address(list, i);
+        if (mb == NULL) {
+            (void)fprintf(
+                stderr,
+                "could not extract mailbox from mailbox-list\n"
+            );
+            return EXIT_FAILURE;
+        }
+        if (mb->addr == NULL) {
+            (void)fprintf(stderr, "could not extract addr from mailbox\n");
+            return EXIT_FAILURE;
+        }
+        const char *idn_addr = internet_address_mailbox_get_idn_addr(mb);
+        if (idn_addr == NULL) {
+            (void)fprintf(stderr, "could not get IDN encoded addr-spec\n");
+            return EXIT_FAILURE;
+        }
+        const char *domain = idn_addr + mb->at + 1;
+
+        if (query_ipn(channel, domain, node_nbr) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int mailrecv_resolver_init(ares_channel_t **channel, const char *servers) {
+    int status;
+    status = ares_library_init(ARES_LIB_INIT_ALL);
+    if (status != ARES_SUCCESS) {
+        (void)fprintf(
+            stderr,
+            "c-ares library initialization issue: %s\n",
+            ares_strerror(status)
+        );
+        return EXIT_FAILURE;
+    }
+    if (!ares_threadsafety()) {
+        (void)fprintf(stderr, "c-ares not compiled with thread support\n");
+        ares_library_cleanup();
+        return EXIT_FAILURE;
+    }
+
+    struct ares_options options = {0};
+    int optmask = 0;
+    optmask |= ARES_OPT_EVENT_THREAD;
+    options.evsys = ARES_EVSYS_DEFAULT;
+
+    status = ares_init_options(channel, &options, optmask);
+    if (status != ARES_SUCCESS) {
+        (void)fprintf(
+            stderr,
+            "c-ares initialization issue: %s\n",
+            ares_strerror(status)
+        );
+        ares_library_cleanup();
+        return EXIT_FAILURE;
+    }
+
+    if (servers != NULL) {
+        status = ares_set_servers_csv(*channel, servers);
+        if (status != ARES_SUCCESS) {
+            (void)fprintf(stderr, "invalid format for list of servers\n");
+            ares_destroy(*channel);
+            ares_library_cleanup();
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+void mailrecv_resolver_destroy(ares_channel_t *channel) {
+    ares_destroy(channel);
+    ares_library_cleanup();
+}
+
+static void digest_payload(
+    const char *data,
+    size_t len,
+    unsigned char digest[DEDUP_DIGEST_LEN]
+) {
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    g_checksum_update(checksum, (const guchar *)data, (gssize)len);
+    gsize digest_len = DEDUP_DIGEST_LEN;
+    g_checksum_get_digest(checksum, digest, &digest_len);
+    g_checksum_free(checksum);
+}
+
+int mailrecv(
+    struct sdrv_str *sdr,
+    const struct mailrecv_options *opts,
+    const DtpcDelivery *dlv,
+    struct mailrecv_msg *msg
+) {
+    msg->data = NULL;
+    msg->len = 0;
+    msg->src_eid = dlv->srcEid;
+    int64_t received = trace_now();
+
+    char *received_data = malloc(dlv->length);
+    if (received_data == NULL) {
+        (void)fprintf(stderr, "malloc failed\n");
+        return EXIT_FAILURE;
+    }
+
+    sdr_read(sdr, received_data, dlv->item, dlv->length);
+
+    /* The trace record is not part of the message, even for duplicates */
+    size_t payload_size = dlv->length;
+    msg->traced = trace_decode(
+        (const unsigned char *)received_data,
+        &payload_size,
+        &msg->trace
+    );
+    msg->trace.recv[TRACE_RECV_RECEIVED] = received;
+    msg->trace.recv[TRACE_RECV_READ] = trace_now();
+
+    if (opts->dedup != NULL) {
+        digest_payload(received_data, payload_size, msg->digest);
+        switch (dedup_check(opts->dedup, msg->digest, time(NULL))) {
+            case 1:
+                (void)fprintf(stderr, "duplicate message discarded\n");
+                free(received_data);
+                return EXIT_SUCCESS;
+            case -1:
+                /* Better to deliver a duplicate than to lose a message */
+                (void)fprintf(stderr, "could not check for duplicates\n");
+                break;
+            default:
+                break;
+        }
+    }
+
+    size_t decompressed_size = 0;
+    Bytef *decompressed = NULL;
+    int pinflate_ret = 1;
+    if (opts->threads > 1) {
+        /* Falls back to inflate_dynamic() for data without a block index */
+        pinflate_ret = pinflate(
+            (const Bytef *)received_data,
+            payload_size,
+            opts->threads,
+            &decompressed,
+            &decompressed_size
+        );
+    }
+    if (pinflate_ret == 1) {
+        decompressed = inflate_dynamic(
+            (const Bytef *)(received_data),
+            payload_size,
+            &decompressed_size
+        );
+    }
+    free(received_data);
+    if (decompressed == NULL) {
+        (void)fprintf(stderr, "decompression failed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (hdrcomp_is_encoded((const char *)decompressed, decompressed_size)) {
+        char *decoded = NULL;
+        size_t decoded_size = 0;
+        int ret = hdrcomp_recv(
+            opts->hdr_state_dir,
+            dlv->srcEid,
+            (const char *)decompressed,
+            decompressed_size,
+            &decoded,
+            &decoded_size
+        );
+        free(decompressed);
+        if (ret == -1) {
+            (void)fprintf(stderr, "header decompression failed\n");
+            return EXIT_FAILURE;
+        }
+        decompressed = (Bytef *)decoded;
+        decompressed_size = decoded_size;
+    }
+    msg->trace.recv[TRACE_RECV_DECOMPRESS] = trace_now();
+
+    GMimeStream *istream = g_mime_stream_mem_new_with_buffer(
+        (char *)decompressed,
+        decompressed_size
+    );
+    if (istream == NULL) {
+        (void)fprintf(stderr, "could not create new GMime memory stream\n");
+        free(decompressed);
+        return EXIT_FAILURE;
+    }
+
+    /* GObject construction can never fail; parser should never be NULL */
+    GMimeParser *parser = g_mime_parser_new_with_stream(istream);
+    g_object_unref(istream);
+
+    GMimeMessage *message = g_mime_parser_construct_message(parser, NULL);
+    g_object_unref(parser);
+    msg->trace.recv[TRACE_RECV_PARSE] = trace_now();
+    if (message == NULL) {
+        (void)fprintf(stderr, "could not parse MIME message\n");
+        if (opts->allow_invalid_mime) {
+            msg->trace.recv[TRACE_RECV_VERIFY] = trace_now();
+            msg->data = (char *)decompressed;
+            msg->len = decompressed_size;
+            return EXIT_SUCCESS;
+        }
+        free(decompressed);
+        return EXIT_FAILURE;
+    }
+    free(decompressed);
+
+    /*
+     * From this point, we assume `message` is a valid MIME message.
+     * (GMime does not accept some values that should be valid, such as
+     * From: Managing Partners:ben@example.com,carol@example.com;
+     * (taken from Section 4 of RFC 6854).)
+     * So ignore `allow_invalid_mime` and treat a failure to parse a header
+     * as a failure to verify the source EID.
+     */
+
+    if (opts->verify_ipn
+        && verify_source(opts->channel, dlv->srcEid, message) != EXIT_SUCCESS)
+    {
+        g_object_unref(message);
+        return EXIT_FAILURE;
+    }
+
+    while (g_mime_header_list_contains(
+        message->parent_object.headers,
+        "Return-Path"
+    ))
+    {
+        g_mime_header_list_remove(
+            message->parent_object.headers,
+            "Return-Path"
+        );
+    }
+
+    /* GObject construction can never fail; ostream should never be NULL */
+    GMimeStream *ostream = g_mime_stream_mem_new();
+    /*
+     * g_mime_format_options_new() uses g_slice_new() which can never return
+     * NULL.
+     */
+    GMimeFormatOptions *format = g_mime_format_options_new();
+    g_mime_format_options_set_newline_format(format, GMIME_NEWLINE_FORMAT_DOS);
+    if (g_mime_object_write_to_stream((GMimeObject *)message, format, ostream)
+        == -1)
+    {
+        (void)fprintf(stderr, "could not format MIME message\n");
+        g_mime_format_options_free(format);
+        g_object_unref(ostream);
+        g_object_unref(message);
+        return EXIT_FAILURE;
+    }
+    g_mime_format_options_free(format);
+    g_object_unref(message);
+
+    GByteArray *bytes =
+        g_mime_stream_mem_get_byte_array((GMimeStreamMem *)ostream);
+    msg->data = malloc(bytes->len);
+    if (msg->data == NULL) {
+        (void)fprintf(stderr, "malloc failed\n");
+        g_object_unref(ostream);
+        return EXIT_FAILURE;
+    }
+    memcpy(msg->data, bytes->data, bytes->len);
+    msg->len = bytes->len;
+    g_object_unref(ostream);
+    msg->trace.recv[TRACE_RECV_VERIFY] = trace_now();
+    return EXIT_SUCCESS;
+}
+
+void mailrecv_delivered(
+    const struct mailrecv_options *opts,
+    const struct mailrecv_msg *msg
+) {
+    if (opts->dedup != NULL
+        && dedup_add(opts->dedup, msg->digest, time(NULL)) == -1)
+    {
+        (void)fprintf(stderr, "could not record delivered message\n");
+    }
+    if (msg->traced && opts->trace_log != NULL) {
+        struct trace t = msg->trace;
+        t.recv[TRACE_RECV_DELIVER] = trace_now();
+        (void)trace_log_recv(opts->trace_log, &t, msg->src_eid);
+    }
+}
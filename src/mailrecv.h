@@ -0,0 +1,78 @@
+#ifndef MAILRECV_H
+#define MAILRECV_H
+
+#include "global.h"
+
+#include <stddef.h>
+
+#include "ares.h"
+#include "dedup.h"
+#include "dtpc.h"
+#include "trace.h"
+
+struct mailrecv_options {
+    int allow_invalid_mime;
+    int verify_ipn;
+    /* Resolver used for IPN verification; may be shared between threads */
+    ares_channel_t *channel;
+    /* Directory holding header compression tables, or NULL for none */
+    const char *hdr_state_dir;
+    /* Filter of delivered messages, or NULL to deliver duplicates */
+    struct dedup *dedup;
+    /* Decompress messages compressed in parallel with this many threads */
+    unsigned int threads;
+    /* Log for completed traces, or NULL for none */
+    const char *trace_log;
+};
+
+struct mailrecv_msg {
+    /* Allocated by malloc(); NULL if there is nothing to deliver */
+    char *data;
+    size_t len;
+    /* Digest of the ADU, if duplicate detection is enabled */
+    unsigned char digest[DEDUP_DIGEST_LEN];
+    /* Set if the ADU carried a trace record */
+    int traced;
+    struct trace trace;
+    /* Source EID of the delivery; valid until it is released */
+    const char *src_eid;
+};
+
+/*
+ * Initialize c-ares and create a channel with its own event thread.
+ * `servers` is an optional comma separated list of DNS servers (see
+ * ares_set_servers_csv(3)).
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. Errors are reported on stderr.
+ */
+int mailrecv_resolver_init(ares_channel_t **channel, const char *servers);
+
+/* Destroy a channel created with mailrecv_resolver_init() */
+void mailrecv_resolver_destroy(ares_channel_t *channel);
+
+/*
+ * Decompress and verify the application data unit in `dlv` (which must have a
+ * result of PayloadPresent) and format it for delivery.
+ * Duplicates of delivered messages are discarded before they are decompressed.
+ * On EXIT_SUCCESS, `msg->data` is the message to deliver, or NULL if it was a
+ * duplicate. The caller is responsible for calling free().
+ * `dlv` is never released; the caller should call dtpc_release_delivery() once
+ * the message has been delivered or rejected.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. Errors are reported on stderr.
+ */
+int mailrecv(
+    struct sdrv_str *sdr,
+    const struct mailrecv_options *opts,
+    const DtpcDelivery *dlv,
+    struct mailrecv_msg *msg
+);
+
+/*
+ * Remember that `msg` was delivered so that later copies are discarded, and
+ * log its trace. Call right after delivering.
+ */
+void mailrecv_delivered(
+    const struct mailrecv_options *opts,
+    const struct mailrecv_msg *msg
+);
+
+#endif /* MAILRECV_H */
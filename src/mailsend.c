@@ -0,0 +1,202 @@
+#include "mailsend.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bp.h"
+#include "hdrcomp.h"
+#include "pdeflate.h"
+#include "trace.h"
+#include "zlib.h"
+
+/* Compress `content` and send it */
+static int send_compressed(
+    struct dtpcsap_st *sap,
+    struct sdrv_str *sdr,
+    const struct mailsend_options *opts,
+    const char *content,
+    size_t content_size
+) {
+    /* Compress content using zlib */
+    Bytef *compressed = NULL;
+    uLong compressed_size = 0;
+    if (opts->threads > 1 && content_size > PDEFLATE_BLOCK_SIZE) {
+        size_t size = 0;
+        if (pdeflate(
+                (const Bytef *)content,
+                content_size,
+                opts->threads,
+                &compressed,
+                &size
+            )
+                == -1
+            || size > UINT_MAX)
+        {
+            (void)fprintf(stderr, "compression failed\n");
+            free(compressed);
+            return EXIT_FAILURE;
+        }
+        compressed_size = (uLong)size;
+    } else {
+        compressed_size = compressBound((uLong)content_size);
+        compressed = malloc(compressed_size);
+        if (compressed == NULL) {
+            fprintf(stderr, "malloc failed\n");
+            return EXIT_FAILURE;
+        }
+
+        if (compress(
+                compressed,
+                &compressed_size,
+                (const Bytef *)content,
+                (uLong)content_size
+            )
+            != Z_OK)
+        {
+            fprintf(stderr, "compression failed\n");
+            free(compressed);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (opts->trace != NULL) {
+        if (compressed_size > UINT_MAX - TRACE_RECORD_LEN) {
+            (void)fprintf(stderr, "content too large to send\n");
+            free(compressed);
+            return EXIT_FAILURE;
+        }
+        Bytef *tmp = realloc(compressed, compressed_size + TRACE_RECORD_LEN);
+        if (tmp == NULL) {
+            (void)fprintf(stderr, "realloc failed\n");
+            free(compressed);
+            return EXIT_FAILURE;
+        }
+        compressed = tmp;
+        opts->trace->send[TRACE_SEND_COMPRESS] = trace_now();
+        trace_encode(opts->trace, compressed + compressed_size);
+        compressed_size += TRACE_RECORD_LEN;
+    }
+
+    if (sdr_begin_xn(sdr) == 0) {
+        (void)fprintf(stderr, "could not initiate a SDR transaction\n");
+        free(compressed);
+        return EXIT_FAILURE;
+    }
+    /*
+     * TODO: verify if we need this check
+     * if (sdr_heap_depleted(sdr) != 0) {
+     *     sdr_exit_xn(sdr);
+     *     (void)fprintf(stderr, "could not send mail; SDR low on heap space\n");
+     *     return EXIT_FAILURE;
+     * }
+     */
+
+    SdrObject adu_payload =
+        sdr_insert(sdr, (char *)compressed, (unsigned long)compressed_size);
+    if (sdr_end_xn(sdr) != 0) {
+        (void)fprintf(stderr, "could not copy data into SDR\n");
+        free(compressed);
+        return EXIT_FAILURE;
+    }
+    if (opts->trace != NULL) {
+        opts->trace->send[TRACE_SEND_SDR] = trace_now();
+    }
+
+    switch (dtpc_send(
+        opts->profile_id,
+        sap,
+        opts->dest_eid,
+        0,
+        0,
+        0,
+        0,
+        NULL,
+        0,
+        NoCustodyRequested,
+        NULL,
+        BP_STD_PRIORITY,
+        adu_payload,
+        (unsigned int)compressed_size
+    ))
+    {
+        case -1:
+            (void)fprintf(stderr, "system failure from dtpc_send\n");
+            free(compressed);
+            return EXIT_FAILURE;
+        case 0:
+            (void)fprintf(stderr, "could not send payload\n");
+            free(compressed);
+            if (sdr_begin_xn(sdr) == 0) {
+                (void)fprintf(stderr, "could not initiate a SDR transaction\n");
+                return EXIT_FAILURE;
+            }
+            sdr_free(sdr, adu_payload);
+            if (sdr_end_xn(sdr) != 0) {
+                (void)fprintf(stderr, "could not free ADU memory from SDR\n");
+            }
+            return EXIT_FAILURE;
+        case 1:
+            /* Fall through */
+        default:
+            break;
+    }
+
+    free(compressed);
+    if (opts->trace != NULL) {
+        opts->trace->send[TRACE_SEND_DTPC] = trace_now();
+        if (opts->trace_log != NULL) {
+            (void)trace_log_send(opts->trace_log, opts->trace, opts->dest_eid);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+int mailsend(
+    struct dtpcsap_st *sap,
+    struct sdrv_str *sdr,
+    const struct mailsend_options *opts,
+    const char *content,
+    size_t content_size
+) {
+    /*
+     * TODO: DTPC API uses unsigned int to specify content size, so we can't
+     * send more than UINT_MAX at once. We should allocate and send multiple
+     * times rather than just once.
+     */
+    if (content_size > UINT_MAX) {
+        (void)fprintf(stderr, "content too large to send\n");
+        return EXIT_FAILURE;
+    }
+
+    struct hdrcomp_send *hdr = NULL;
+    char *encoded = NULL;
+    size_t encoded_size = 0;
+    if (opts->hdr_state_dir != NULL) {
+        hdr = hdrcomp_send_begin(
+            opts->hdr_state_dir,
+            opts->dest_eid,
+            content,
+            content_size,
+            &encoded,
+            &encoded_size
+        );
+        if (hdr == NULL) {
+            (void)fprintf(stderr, "header compression failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (encoded != NULL) {
+        content = encoded;
+        content_size = encoded_size;
+    }
+    if (opts->trace != NULL) {
+        opts->trace->send[TRACE_SEND_HDRCOMP] = trace_now();
+    }
+
+    /* The header table is held until dtpc_send() has taken the ADU */
+    int ret = send_compressed(sap, sdr, opts, content, content_size);
+    hdrcomp_send_end(hdr, ret == EXIT_SUCCESS);
+    free(encoded);
+    return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef MAILSEND_H
+#define MAILSEND_H
+
+#include "global.h"
+
+#include <stddef.h>
+
+#include "dtpc.h"
+#include "trace.h"
+
+struct mailsend_options {
+    unsigned int profile_id;
+    char *dest_eid;
+    /* Directory holding header compression tables, or NULL to disable */
+    const char *hdr_state_dir;
+    /* Compress large messages with up to this many threads */
+    unsigned int threads;
+    /* Trace to stamp and attach to the ADU, or NULL to disable tracing */
+    struct trace *trace;
+    /* Log for the sending side of traces, or NULL for none */
+    const char *trace_log;
+};
+
+/*
+ * Compress `content` and send it as a single DTPC application data unit on
+ * `sap` with transmission profile `opts->profile_id` to the DTPC application
+ * receiving at `opts->dest_eid`.
+ * If `opts->trace` is set, the sending stages are stamped in it and a trace
+ * record is appended to the ADU.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. Errors are reported on stderr.
+ */
+int mailsend(
+    struct dtpcsap_st *sap,
+    struct sdrv_str *sdr,
+    const struct mailsend_options *opts,
+    const char *content,
+    size_t content_size
+);
+
+#endif /* MAILSEND_H */
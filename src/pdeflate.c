@@ -0,0 +1,321 @@
+#include "pdeflate.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Layout:
+ *   zlib header, block 0 ... block n-1, adler32 of the input
+ *   index: (compressed length, uncompressed length) of each block
+ *   n, PDEFLATE_MAGIC
+ * All integers are 32-bit big endian. Every block but the last ends with an
+ * empty stored block (Z_SYNC_FLUSH) so the next one starts on a byte boundary,
+ * and no block refers to data in another.
+ */
+#define PDEFLATE_MAGIC 0x42505a49 /* "BPZI" */
+#define ZLIB_HEADER_LEN 2
+#define ZLIB_TRAILER_LEN 4
+#define INDEX_ENTRY_LEN 8
+#define INDEX_FOOTER_LEN 8
+
+struct block {
+    const Bytef *in;
+    size_t in_len;
+    Bytef *out;
+    size_t out_len;
+    uLong check; /* adler32 of the uncompressed data */
+    int last;
+    int err;
+};
+
+struct worker {
+    pthread_t thread;
+    struct block *blocks;
+    size_t block_cnt;
+    size_t first;
+    size_t stride;
+};
+
+static void put_be32(Bytef *p, uint32_t v) {
+    p[0] = (Bytef)(v >> 24);
+    p[1] = (Bytef)(v >> 16);
+    p[2] = (Bytef)(v >> 8);
+    p[3] = (Bytef)v;
+}
+
+static uint32_t get_be32(const Bytef *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+        | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void deflate_block(struct block *b) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    b->check = adler32(adler32(0, NULL, 0), b->in, (uInt)b->in_len);
+    if (deflateInit2(
+            &strm,
+            Z_DEFAULT_COMPRESSION,
+            Z_DEFLATED,
+            -MAX_WBITS, /* raw deflate */
+            8,
+            Z_DEFAULT_STRATEGY
+        )
+        != Z_OK)
+    {
+        b->err = 1;
+        return;
+    }
+    /* deflateBound() does not count the empty stored block from a flush */
+    size_t bound = deflateBound(&strm, (uLong)b->in_len) + 16;
+    b->out = malloc(bound);
+    if (b->out == NULL) {
+        deflateEnd(&strm);
+        b->err = 1;
+        return;
+    }
+    strm.next_in = (Bytef *)(uintptr_t)b->in; /* safe cast from const */
+    strm.avail_in = (uInt)b->in_len;
+    strm.next_out = b->out;
+    strm.avail_out = (uInt)bound;
+
+    int ret = deflate(&strm, b->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (ret != (b->last ? Z_STREAM_END : Z_OK) || strm.avail_in != 0) {
+        b->err = 1;
+    }
+    b->out_len = bound - strm.avail_out;
+    deflateEnd(&strm);
+}
+
+static void inflate_block(struct block *b) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+
+    if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+        b->err = 1;
+        return;
+    }
+    strm.next_in = (Bytef *)(uintptr_t)b->in; /* safe cast from const */
+    strm.avail_in = (uInt)b->in_len;
+    strm.next_out = b->out;
+    strm.avail_out = (uInt)b->out_len;
+
+    int ret = inflate(&strm, Z_SYNC_FLUSH);
+    if (ret != (b->last ? Z_STREAM_END : Z_OK) || strm.avail_in != 0
+        || strm.avail_out != 0)
+    {
+        b->err = 1;
+    }
+    inflateEnd(&strm);
+    b->check = adler32(adler32(0, NULL, 0), b->out, (uInt)b->out_len);
+}
+
+static void *deflate_worker(void *arg) {
+    struct worker *w = arg;
+    for (size_t i = w->first; i < w->block_cnt; i += w->stride) {
+        deflate_block(&w->blocks[i]);
+    }
+    return NULL;
+}
+
+static void *inflate_worker(void *arg) {
+    struct worker *w = arg;
+    for (size_t i = w->first; i < w->block_cnt; i += w->stride) {
+        inflate_block(&w->blocks[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Run `fn` on every block with up to `threads` threads, including the calling
+ * thread. Returns -1 if any block failed.
+ */
+static int run_workers(
+    struct block *blocks,
+    size_t block_cnt,
+    unsigned int threads,
+    void *(*fn)(void *)
+) {
+    size_t worker_cnt = threads < block_cnt ? threads : block_cnt;
+    if (worker_cnt == 0) {
+        worker_cnt = 1;
+    }
+    struct worker *workers = calloc(worker_cnt, sizeof(*workers));
+    if (workers == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < worker_cnt; i++) {
+        workers[i].blocks = blocks;
+        workers[i].block_cnt = block_cnt;
+        workers[i].first = i;
+        workers[i].stride = worker_cnt;
+    }
+    size_t started = 1;
+    for (; started < worker_cnt; started++) {
+        struct worker *w = &workers[started];
+        if (pthread_create(&w->thread, NULL, fn, w) != 0) {
+            break;
+        }
+    }
+    /* The calling thread also does the share of threads that failed to start */
+    fn(&workers[0]);
+    for (size_t i = started; i < worker_cnt; i++) {
+        fn(&workers[i]);
+    }
+    for (size_t i = 1; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+
+    for (size_t i = 0; i < block_cnt; i++) {
+        if (blocks[i].err) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pdeflate(
+    const Bytef *in,
+    size_t in_len,
+    unsigned int threads,
+    Bytef **out,
+    size_t *out_len
+) {
+    if (in_len > UINT32_MAX) {
+        return -1;
+    }
+    size_t block_cnt = (in_len + PDEFLATE_BLOCK_SIZE - 1) / PDEFLATE_BLOCK_SIZE;
+    if (block_cnt == 0) {
+        block_cnt = 1; /* An empty last block */
+    }
+    struct block *blocks = calloc(block_cnt, sizeof(*blocks));
+    if (blocks == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < block_cnt; i++) {
+        blocks[i].in = in + i * PDEFLATE_BLOCK_SIZE;
+        blocks[i].in_len = i == block_cnt - 1
+            ? in_len - i * PDEFLATE_BLOCK_SIZE
+            : PDEFLATE_BLOCK_SIZE;
+        blocks[i].last = i == block_cnt - 1;
+    }
+
+    int ret = run_workers(blocks, block_cnt, threads, &deflate_worker);
+
+    size_t total = ZLIB_HEADER_LEN + ZLIB_TRAILER_LEN
+        + block_cnt * INDEX_ENTRY_LEN + INDEX_FOOTER_LEN;
+    for (size_t i = 0; ret == 0 && i < block_cnt; i++) {
+        total += blocks[i].out_len;
+    }
+    Bytef *buf = ret == 0 ? malloc(total) : NULL;
+    if (buf == NULL) {
+        for (size_t i = 0; i < block_cnt; i++) {
+            free(blocks[i].out);
+        }
+        free(blocks);
+        return -1;
+    }
+
+    /* zlib header for deflate with a 32K window at the default level */
+    Bytef *p = buf;
+    *p++ = 0x78;
+    *p++ = 0x9c;
+    uLong check = adler32(0, NULL, 0);
+    for (size_t i = 0; i < block_cnt; i++) {
+        memcpy(p, blocks[i].out, blocks[i].out_len);
+        p += blocks[i].out_len;
+        check =
+            adler32_combine(check, blocks[i].check, (z_off_t)blocks[i].in_len);
+    }
+    put_be32(p, (uint32_t)check);
+    p += ZLIB_TRAILER_LEN;
+    for (size_t i = 0; i < block_cnt; i++) {
+        put_be32(p, (uint32_t)blocks[i].out_len);
+        put_be32(p + 4, (uint32_t)blocks[i].in_len);
+        p += INDEX_ENTRY_LEN;
+        free(blocks[i].out);
+    }
+    put_be32(p, (uint32_t)block_cnt);
+    put_be32(p + 4, PDEFLATE_MAGIC);
+    free(blocks);
+
+    *out = buf;
+    *out_len = total;
+    return 0;
+}
+
+int pinflate(
+    const Bytef *in,
+    size_t in_len,
+    unsigned int threads,
+    Bytef **out,
+    size_t *out_len
+) {
+    size_t min_len = ZLIB_HEADER_LEN + ZLIB_TRAILER_LEN + INDEX_FOOTER_LEN;
+    if (in_len < min_len || get_be32(in + in_len - 4) != PDEFLATE_MAGIC
+        || (in[0] & 0x0f) != Z_DEFLATED || (in[1] & 0x20) != 0)
+    {
+        return 1;
+    }
+    size_t block_cnt = get_be32(in + in_len - INDEX_FOOTER_LEN);
+    if (block_cnt == 0 || block_cnt > (in_len - min_len) / INDEX_ENTRY_LEN) {
+        return 1;
+    }
+    const Bytef *index =
+        in + in_len - INDEX_FOOTER_LEN - block_cnt * INDEX_ENTRY_LEN;
+
+    /* The index must describe exactly the data in front of it */
+    size_t stream_len =
+        (size_t)(index - in) - ZLIB_HEADER_LEN - ZLIB_TRAILER_LEN;
+    size_t comp_total = 0;
+    size_t total = 0;
+    for (size_t i = 0; i < block_cnt; i++) {
+        comp_total += get_be32(index + i * INDEX_ENTRY_LEN);
+        total += get_be32(index + i * INDEX_ENTRY_LEN + 4);
+        if (comp_total > stream_len) {
+            return 1;
+        }
+    }
+    if (comp_total != stream_len) {
+        return 1;
+    }
+
+    struct block *blocks = calloc(block_cnt, sizeof(*blocks));
+    Bytef *buf = malloc(total == 0 ? 1 : total);
+    if (blocks == NULL || buf == NULL) {
+        free(blocks);
+        free(buf);
+        return -1;
+    }
+    const Bytef *p = in + ZLIB_HEADER_LEN;
+    Bytef *q = buf;
+    for (size_t i = 0; i < block_cnt; i++) {
+        blocks[i].in = p;
+        blocks[i].in_len = get_be32(index + i * INDEX_ENTRY_LEN);
+        blocks[i].out = q;
+        blocks[i].out_len = get_be32(index + i * INDEX_ENTRY_LEN + 4);
+        blocks[i].last = i == block_cnt - 1;
+        p += blocks[i].in_len;
+        q += blocks[i].out_len;
+    }
+
+    int ret = run_workers(blocks, block_cnt, threads, &inflate_worker);
+    uLong check = adler32(0, NULL, 0);
+    for (size_t i = 0; ret == 0 && i < block_cnt; i++) {
+        check =
+            adler32_combine(check, blocks[i].check, (z_off_t)blocks[i].out_len);
+    }
+    free(blocks);
+    if (ret != 0 || check != get_be32(p)) {
+        free(buf);
+        return -1;
+    }
+
+    *out = buf;
+    *out_len = total;
+    return 0;
+}
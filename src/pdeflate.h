@@ -0,0 +1,49 @@
+#ifndef PDEFLATE_H
+#define PDEFLATE_H
+
+#include "global.h"
+
+#include <stddef.h>
+
+#include "zlib.h"
+
+/*
+ * Parallel zlib compression in the style of pigz.
+ * The input is split into blocks that are deflated independently on a pool of
+ * threads and joined into a single zlib stream, so any zlib inflater can
+ * decompress it. An index of the blocks is appended after the end of the zlib
+ * stream (where inflate() stops reading), which lets pinflate() decompress the
+ * blocks in parallel as well.
+ */
+
+#define PDEFLATE_BLOCK_SIZE (128 * 1024)
+#define PDEFLATE_MAX_THREADS 256
+
+/*
+ * Compress `in` using up to `threads` threads.
+ * On success, `*out` points to `*out_len` bytes allocated by malloc().
+ * Returns 0 on success, -1 on failure.
+ */
+int pdeflate(
+    const Bytef *in,
+    size_t in_len,
+    unsigned int threads,
+    Bytef **out,
+    size_t *out_len
+);
+
+/*
+ * Decompress data produced by pdeflate() using up to `threads` threads.
+ * On success, `*out` points to `*out_len` bytes allocated by malloc().
+ * Returns 0 on success, 1 if `in` has no block index (use inflate() instead)
+ * and -1 on failure.
+ */
+int pinflate(
+    const Bytef *in,
+    size_t in_len,
+    unsigned int threads,
+    Bytef **out,
+    size_t *out_len
+);
+
+#endif /* PDEFLATE_H */
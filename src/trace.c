@@ -0,0 +1,254 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_MAGIC 0x42505452 /* "BPTR" */
+#define TRACE_VERSION 1
+/* Sending stages carried in the record after TRACE_SEND_START */
+#define TRACE_RECORD_STAGES TRACE_SEND_COMPRESS
+#define TRACE_MAX_LINE 1024
+
+static const char *const send_stage_names[TRACE_SEND_STAGES] = {
+    [TRACE_SEND_READ] = "read",
+    [TRACE_SEND_HDRCOMP] = "hdrcomp",
+    [TRACE_SEND_COMPRESS] = "compress",
+    [TRACE_SEND_SDR] = "sdr",
+    [TRACE_SEND_DTPC] = "dtpc",
+};
+
+static const char *const recv_stage_names[TRACE_RECV_STAGES] = {
+    [TRACE_RECV_READ] = "recv_read",
+    [TRACE_RECV_DECOMPRESS] = "decompress",
+    [TRACE_RECV_PARSE] = "parse",
+    [TRACE_RECV_VERIFY] = "verify",
+    [TRACE_RECV_DELIVER] = "deliver",
+};
+
+static void put_be(unsigned char *p, uint64_t v, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        p[i] = (unsigned char)(v >> (8 * (len - 1 - i)));
+    }
+}
+
+static uint64_t get_be(const unsigned char *p, size_t len) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < len; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+int64_t trace_now(void) {
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_init(struct trace *t) {
+    memset(t, 0, sizeof(*t));
+    unsigned char id[sizeof(t->id)];
+    ssize_t n;
+    do {
+        n = getrandom(id, sizeof(id), 0);
+    } while (n == -1 && errno == EINTR);
+    if (n != (ssize_t)sizeof(id)) {
+        perror("getrandom");
+        return -1;
+    }
+    t->id = get_be(id, sizeof(id));
+    t->send[TRACE_SEND_START] = trace_now();
+    return 0;
+}
+
+void trace_encode(const struct trace *t, unsigned char buf[TRACE_RECORD_LEN]) {
+    unsigned char *p = buf;
+    *p++ = TRACE_VERSION;
+    put_be(p, t->id, 8);
+    p += 8;
+    put_be(p, (uint64_t)t->send[TRACE_SEND_START], 8);
+    p += 8;
+    /* Stages are stored as offsets from the start, which fit in 32 bits */
+    for (int i = 1; i <= TRACE_RECORD_STAGES; i++) {
+        int64_t off = t->send[i] - t->send[TRACE_SEND_START];
+        if (t->send[i] == 0 || off < 0) {
+            off = 0;
+        } else if (off > UINT32_MAX) {
+            off = UINT32_MAX;
+        }
+        put_be(p, (uint64_t)off, 4);
+        p += 4;
+    }
+    put_be(p, TRACE_MAGIC, 4);
+}
+
+int trace_decode(const unsigned char *adu, size_t *adu_len, struct trace *t) {
+    if (*adu_len < TRACE_RECORD_LEN
+        || get_be(adu + *adu_len - 4, 4) != TRACE_MAGIC)
+    {
+        return 0;
+    }
+    const unsigned char *p = adu + *adu_len - TRACE_RECORD_LEN;
+    if (*p++ != TRACE_VERSION) {
+        return 0;
+    }
+    memset(t, 0, sizeof(*t));
+    t->id = get_be(p, 8);
+    p += 8;
+    t->send[TRACE_SEND_START] = (int64_t)get_be(p, 8);
+    p += 8;
+    for (int i = 1; i <= TRACE_RECORD_STAGES; i++) {
+        t->send[i] = t->send[TRACE_SEND_START] + (int64_t)get_be(p, 4);
+        p += 4;
+    }
+    *adu_len -= TRACE_RECORD_LEN;
+    return 1;
+}
+
+/* Append `stage`=`end - start` to `line` */
+static void append_stage(
+    char *line,
+    size_t *len,
+    const char *stage,
+    int64_t start,
+    int64_t end
+) {
+    if (*len >= TRACE_MAX_LINE) {
+        return;
+    }
+    int n = snprintf(
+        line + *len,
+        TRACE_MAX_LINE - *len,
+        " %s=%lld",
+        stage,
+        (long long)(end - start)
+    );
+    if (n > 0) {
+        *len += (size_t)n;
+    }
+}
+
+/* Append the time spent in each of stages `first` to `last` of `stamps` */
+static void append_stages(
+    char *line,
+    size_t *len,
+    const char *const *names,
+    const int64_t *stamps,
+    int first,
+    int last
+) {
+    for (int i = first; i <= last; i++) {
+        append_stage(line, len, names[i], stamps[i - 1], stamps[i]);
+    }
+}
+
+/* Write `line` to the trace log at `path` in one write(2) */
+static int append_line(const char *path, char *line, size_t len) {
+    if (len >= TRACE_MAX_LINE - 1) {
+        (void)fprintf(stderr, "trace log line too long\n");
+        return -1;
+    }
+    line[len++] = '\n';
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1) {
+        perror(path);
+        return -1;
+    }
+    ssize_t n;
+    do {
+        n = write(fd, line, len);
+    } while (n == -1 && errno == EINTR);
+    if (n != (ssize_t)len) {
+        perror("could not write to trace log");
+        close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+/* Start a line with the fields common to both sides */
+static size_t begin_line(
+    char *line,
+    const char *side,
+    const struct trace *t,
+    const char *peer_key,
+    const char *peer
+) {
+    int n = snprintf(
+        line,
+        TRACE_MAX_LINE,
+        "%s id=%016llx %s=%.256s time=%lld",
+        side,
+        (unsigned long long)t->id,
+        peer_key,
+        peer,
+        (long long)t->send[TRACE_SEND_START]
+    );
+    return n < 0 ? 0 : (size_t)n;
+}
+
+int trace_log_send(const char *path, const struct trace *t, const char *dest) {
+    char line[TRACE_MAX_LINE];
+    size_t len = begin_line(line, "send", t, "dest", dest);
+
+    append_stages(
+        line,
+        &len,
+        send_stage_names,
+        t->send,
+        1,
+        TRACE_SEND_STAGES - 1
+    );
+    append_stage(
+        line,
+        &len,
+        "total",
+        t->send[TRACE_SEND_START],
+        t->send[TRACE_SEND_DTPC]
+    );
+    return append_line(path, line, len);
+}
+
+int trace_log_recv(const char *path, const struct trace *t, const char *src) {
+    char line[TRACE_MAX_LINE];
+    size_t len = begin_line(line, "recv", t, "src", src);
+
+    append_stages(
+        line,
+        &len,
+        send_stage_names,
+        t->send,
+        1,
+        TRACE_RECORD_STAGES
+    );
+    /* From the end of the record to dtpc_receive() on this node */
+    append_stage(
+        line,
+        &len,
+        "transit",
+        t->send[TRACE_RECORD_STAGES],
+        t->recv[TRACE_RECV_RECEIVED]
+    );
+    append_stages(
+        line,
+        &len,
+        recv_stage_names,
+        t->recv,
+        1,
+        TRACE_RECV_STAGES - 1
+    );
+    append_stage(
+        line,
+        &len,
+        "total",
+        t->send[TRACE_SEND_START],
+        t->recv[TRACE_RECV_DELIVER]
+    );
+    return append_line(path, line, len);
+}
@@ -0,0 +1,87 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "global.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * End-to-end latency tracing.
+ * The sender appends a trace record to the ADU holding a random trace id and
+ * the times at which the message went through each sending stage. The
+ * receiver strips the record, adds the times of its own stages and appends the
+ * completed span to a trace log, one line per message:
+ *
+ *   recv id=<hex> src=<eid> time=<us> <stage>=<us> ... total=<us>
+ *
+ * where `time` is when the message was first seen by the sender and each
+ * stage is the time in microseconds spent in it. The sender may log its side
+ * of the span (including the stages after the record was written) on a line
+ * starting with "send". Times are taken from the real-time clock, so the
+ * transit time is only as good as the clock synchronization between nodes.
+ */
+
+enum trace_send_stage {
+    TRACE_SEND_START,
+    TRACE_SEND_READ, /* message read */
+    TRACE_SEND_HDRCOMP, /* header compressed */
+    TRACE_SEND_COMPRESS, /* deflated; the record is written here */
+    TRACE_SEND_SDR, /* copied into the SDR */
+    TRACE_SEND_DTPC, /* accepted by dtpc_send() */
+    TRACE_SEND_STAGES,
+};
+
+enum trace_recv_stage {
+    TRACE_RECV_RECEIVED, /* returned by dtpc_receive() */
+    TRACE_RECV_READ, /* read from the SDR */
+    TRACE_RECV_DECOMPRESS, /* inflated and header decoded */
+    TRACE_RECV_PARSE, /* parsed as MIME */
+    TRACE_RECV_VERIFY, /* source verified and message formatted */
+    TRACE_RECV_DELIVER, /* delivered */
+    TRACE_RECV_STAGES,
+};
+
+/* Length of the trace record appended to ADUs */
+#define TRACE_RECORD_LEN 33
+
+struct trace {
+    uint64_t id;
+    /* Microseconds since the epoch; 0 if the stage was not reached */
+    int64_t send[TRACE_SEND_STAGES];
+    int64_t recv[TRACE_RECV_STAGES];
+};
+
+/* Microseconds since the epoch */
+int64_t trace_now(void);
+
+/*
+ * Start a new trace with a random id at the current time.
+ * Returns 0 on success, -1 on failure.
+ */
+int trace_init(struct trace *t);
+
+/* Write the record for `t` (up to TRACE_SEND_COMPRESS) into `buf` */
+void trace_encode(const struct trace *t, unsigned char buf[TRACE_RECORD_LEN]);
+
+/*
+ * Look for a trace record at the end of the `*adu_len` bytes of `adu`. If
+ * there is one, `t` is filled in and `*adu_len` is shortened to leave it out.
+ * Returns 1 if a record was found, 0 otherwise.
+ */
+int trace_decode(const unsigned char *adu, size_t *adu_len, struct trace *t);
+
+/*
+ * Append the sending side of `t` to the trace log at `path`.
+ * Returns 0 on success, -1 on failure. Errors are reported on stderr.
+ */
+int trace_log_send(const char *path, const struct trace *t, const char *dest);
+
+/*
+ * Append the completed span `t` of a message received from `src` to the trace
+ * log at `path`.
+ * Returns 0 on success, -1 on failure. Errors are reported on stderr.
+ */
+int trace_log_recv(const char *path, const struct trace *t, const char *src);
+
+#endif /* TRACE_H */
@@ -0,0 +1,176 @@
+/*
+ * Compare the size of messages compressed with zlib alone against messages
+ * whose header was encoded with hdrcomp before zlib. The messages are encoded
+ * in the order given, as if they were all sent to the same node, and every
+ * message is decoded to check that it is reproduced byte for byte. The
+ * receiver acknowledges its table after every message, as if mail flowed back
+ * between each of them.
+ *
+ * usage: bench_hdrcomp [-r rounds] message ...
+ */
+#include "hdrcomp.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zlib.h"
+
+static size_t zlib_size(const char *data, size_t len) {
+    uLong size = compressBound((uLong)len);
+    Bytef *buf = malloc(size);
+    if (buf == NULL
+        || compress(buf, &size, (const Bytef *)data, (uLong)len) != Z_OK)
+    {
+        (void)fprintf(stderr, "compression failed\n");
+        exit(EXIT_FAILURE);
+    }
+    free(buf);
+    return (size_t)size;
+}
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    char *data = NULL;
+    size_t cap = 0;
+    *len = 0;
+    for (;;) {
+        if (*len == cap) {
+            cap = cap == 0 ? 4096 : cap * 2;
+            data = realloc(data, cap);
+            if (data == NULL) {
+                (void)fprintf(stderr, "realloc failed\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        size_t n = fread(data + *len, 1, cap - *len, f);
+        if (n == 0) {
+            break;
+        }
+        *len += n;
+    }
+    (void)fclose(f);
+    return data;
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    unsigned long rounds = 1;
+
+    while ((ch = getopt(argc, argv, "r:")) != -1) {
+        switch (ch) {
+            case 'r':
+                errno = 0;
+                rounds = strtoul(optarg, NULL, 0);
+                if (errno != 0 || rounds == 0) {
+                    (void)fprintf(stderr, "invalid number of rounds\n");
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                (void)fprintf(
+                    stderr,
+                    "usage: bench_hdrcomp [-r rounds] message ...\n"
+                );
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    struct hdr_table *send = calloc(1, sizeof(*send));
+    struct hdr_recv_tables *recv = calloc(1, sizeof(*recv));
+    struct hdr_ack none = {0, 0};
+    if (send == NULL || recv == NULL) {
+        (void)fprintf(stderr, "calloc failed\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t total_raw = 0;
+    size_t total_zlib = 0;
+    size_t total_hdrcomp = 0;
+    (void)printf(
+        "%-40s %8s %8s %8s %8s\n",
+        "message",
+        "raw",
+        "zlib",
+        "hdrcomp",
+        "saved"
+    );
+    for (unsigned long r = 0; r < rounds; r++) {
+        for (int i = 0; i < argc; i++) {
+            size_t len;
+            char *data = read_file(argv[i], &len);
+
+            char *encoded;
+            size_t encoded_len;
+            if (hdrcomp_encode(send, &none, data, len, &encoded, &encoded_len)
+                == -1)
+            {
+                (void)fprintf(stderr, "%s: encoding failed\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            size_t hdrcomp_size;
+            if (encoded == NULL) {
+                /* Header could not be parsed; sent as is */
+                hdrcomp_size = zlib_size(data, len);
+            } else {
+                hdrcomp_size = zlib_size(encoded, encoded_len);
+                char *decoded;
+                size_t decoded_len;
+                struct hdr_ack ack;
+                if (hdrcomp_decode(
+                        recv,
+                        &ack,
+                        encoded,
+                        encoded_len,
+                        &decoded,
+                        &decoded_len
+                    )
+                        == -1
+                    || decoded_len != len || memcmp(decoded, data, len) != 0)
+                {
+                    (void)fprintf(stderr, "%s: round trip failed\n", argv[i]);
+                    return EXIT_FAILURE;
+                }
+                free(decoded);
+                free(encoded);
+                hdrcomp_ack(recv, &ack);
+                hdrcomp_acked(send, &ack);
+            }
+
+            size_t zlib_len = zlib_size(data, len);
+            const char *name = strrchr(argv[i], '/');
+            (void)printf(
+                "%-40s %8zu %8zu %8zu %8ld\n",
+                name == NULL ? argv[i] : name + 1,
+                len,
+                zlib_len,
+                hdrcomp_size,
+                (long)zlib_len - (long)hdrcomp_size
+            );
+            total_raw += len;
+            total_zlib += zlib_len;
+            total_hdrcomp += hdrcomp_size;
+            free(data);
+        }
+    }
+    (void)printf(
+        "%-40s %8zu %8zu %8zu %8ld\n",
+        "total",
+        total_raw,
+        total_zlib,
+        total_hdrcomp,
+        (long)total_zlib - (long)total_hdrcomp
+    );
+
+    free(send);
+    free(recv);
+    return EXIT_SUCCESS;
+}
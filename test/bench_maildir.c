@@ -0,0 +1,231 @@
+/*
+ * Compare Maildir delivery with one fsync per message, as done by a typical
+ * MDA, against group commit with maildir_add(). Messages are delivered into a
+ * Maildir created under `dir` (the current directory by default), which should
+ * be on the file system being measured; fsync() is free on tmpfs.
+ *
+ * usage: bench_maildir [-n messages] [-s size] [-w window_ms] [dir]
+ */
+#include "maildir.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static unsigned long committed = 0;
+static unsigned long failed = 0;
+
+static double now(void) {
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what) {
+    perror(what);
+    exit(EXIT_FAILURE);
+}
+
+/* Deliver like an MDA: sync the file, rename it, sync the directory */
+static void deliver_fsync(
+    const char *dir,
+    unsigned long i,
+    const char *msg,
+    size_t len
+) {
+    char tmp_path[PATH_MAX];
+    char new_path[PATH_MAX];
+    char new_dir[PATH_MAX];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/tmp/fsync.%lu", dir, i)
+            >= (int)sizeof(tmp_path)
+        || snprintf(new_path, sizeof(new_path), "%s/new/fsync.%lu", dir, i)
+            >= (int)sizeof(new_path)
+        || snprintf(new_dir, sizeof(new_dir), "%s/new", dir)
+            >= (int)sizeof(new_dir))
+    {
+        (void)fprintf(stderr, "Maildir path too long\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 || write(fd, msg, len) != (ssize_t)len || fsync(fd) == -1
+        || close(fd) == -1)
+    {
+        die(tmp_path);
+    }
+    if (rename(tmp_path, new_path) == -1) {
+        die(new_path);
+    }
+    int dir_fd = open(new_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1 || fsync(dir_fd) == -1) {
+        die(new_dir);
+    }
+    (void)close(dir_fd);
+}
+
+static void on_commit(void *arg, int ok) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    committed++;
+    failed += !ok;
+    pthread_cond_signal(&done);
+    pthread_mutex_unlock(&lock);
+}
+
+/* Remove the messages in `dir`/`sub`; returns how many there were */
+static unsigned long clear_dir(const char *dir, const char *sub) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, sub) >= (int)sizeof(path)) {
+        (void)fprintf(stderr, "Maildir path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    DIR *dirp = opendir(path);
+    if (dirp == NULL) {
+        die(path);
+    }
+    unsigned long cnt = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dirp)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        if (unlinkat(dirfd(dirp), ent->d_name, 0) == -1) {
+            perror(ent->d_name);
+        }
+        cnt++;
+    }
+    (void)closedir(dirp);
+    (void)rmdir(path);
+    return cnt;
+}
+
+static unsigned long parse_arg(const char *arg, int ch) {
+    errno = 0;
+    char *endptr;
+    unsigned long v = strtoul(arg, &endptr, 0);
+    if (errno != 0 || endptr == arg || *endptr != '\0' || v > UINT_MAX) {
+        (void)fprintf(stderr, "invalid -%c argument\n", ch);
+        exit(EXIT_FAILURE);
+    }
+    return v;
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    unsigned long count = 2000;
+    unsigned long size = 4096;
+    unsigned long window_ms = MAILDIR_DEFAULT_WINDOW_MS;
+
+    while ((ch = getopt(argc, argv, "n:s:w:")) != -1) {
+        switch (ch) {
+            case 'n':
+                count = parse_arg(optarg, ch);
+                break;
+            case 's':
+                size = parse_arg(optarg, ch);
+                break;
+            case 'w':
+                window_ms = parse_arg(optarg, ch);
+                break;
+            default:
+                (void)fprintf(
+                    stderr,
+                    "usage: bench_maildir [-n messages] [-s size]"
+                    " [-w window_ms] [dir]\n"
+                );
+                return EXIT_FAILURE;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    char dir[PATH_MAX];
+    if (snprintf(
+            dir,
+            sizeof(dir),
+            "%s/bench_maildir.XXXXXX",
+            argc > 0 ? argv[0] : "."
+        )
+        >= (int)sizeof(dir))
+    {
+        (void)fprintf(stderr, "directory path too long\n");
+        return EXIT_FAILURE;
+    }
+    if (mkdtemp(dir) == NULL) {
+        die("mkdtemp");
+    }
+
+    char *msg = malloc(size);
+    if (msg == NULL) {
+        die("malloc");
+    }
+    for (unsigned long i = 0; i < size; i++) {
+        msg[i] = (i + 1) % 72 == 0 ? '\n' : (char)('a' + i % 26);
+    }
+
+    /* Creates tmp/, new/ and cur/ for the per-message run too */
+    struct maildir *md = maildir_open(dir, (unsigned int)window_ms);
+    if (md == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    double start = now();
+    for (unsigned long i = 0; i < count; i++) {
+        deliver_fsync(dir, i, msg, size);
+    }
+    double fsync_time = now() - start;
+
+    start = now();
+    for (unsigned long i = 0; i < count; i++) {
+        if (maildir_add(md, msg, size, &on_commit, NULL) == -1) {
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_mutex_lock(&lock);
+    while (committed < count) {
+        pthread_cond_wait(&done, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+    double group_time = now() - start;
+    maildir_close(md);
+
+    (void)printf("%lu messages of %lu bytes in %s\n", count, size, dir);
+    (void)printf(
+        "%-28s %10.0f messages/s\n",
+        "fsync per message",
+        (double)count / fsync_time
+    );
+    char label[64];
+    (void)snprintf(label, sizeof(label), "group commit (%lu ms)", window_ms);
+    (void)printf(
+        "%-28s %10.0f messages/s (%.1fx)\n",
+        label,
+        (double)count / group_time,
+        fsync_time / group_time
+    );
+
+    unsigned long delivered = clear_dir(dir, "new");
+    (void)clear_dir(dir, "tmp");
+    (void)clear_dir(dir, "cur");
+    (void)rmdir(dir);
+    free(msg);
+    if (failed != 0 || delivered != 2 * count) {
+        (void)fprintf(
+            stderr,
+            "%lu commits failed, %lu of %lu messages in new\n",
+            failed,
+            delivered,
+            2 * count
+        );
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
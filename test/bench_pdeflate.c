@@ -0,0 +1,198 @@
+/*
+ * Measure how parallel compression scales with the number of threads. A
+ * semi-compressible input (mail-like text with random tokens) is compressed
+ * and decompressed with 1 to `max_threads` threads and compared against a
+ * single compress() call. Every result is decompressed with plain uncompress()
+ * as well, to check that the output is an ordinary zlib stream.
+ *
+ * usage: bench_pdeflate [-n max_threads] [-s size_mb]
+ */
+#include "pdeflate.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+/* Lines of words from a small vocabulary mixed with random base64 tokens */
+static Bytef *make_input(size_t len) {
+    static const char *const words[] = {
+        "the",     "bundle",  "custody", "node",    "contact", "delay",
+        "message", "header",  "from",    "to",      "subject", "received",
+        "with",    "by",      "for",     "id",      "mail",    "relay",
+        "ipn",     "dtn",     "queue",   "deliver", "status",  "report",
+    };
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const size_t word_cnt = sizeof(words) / sizeof(words[0]);
+
+    Bytef *buf = malloc(len);
+    if (buf == NULL) {
+        (void)fprintf(stderr, "malloc failed\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t col = 0;
+    for (size_t i = 0; i < len;) {
+        uint64_t r = next_random();
+        if (col >= 72) {
+            buf[i++] = '\n';
+            col = 0;
+        } else if (r % 4 == 0) {
+            for (unsigned int j = 0; j < 8 && i < len; j++, col++) {
+                buf[i++] = (Bytef)b64[(r >> (8 + 6 * j)) % 64];
+            }
+        } else {
+            const char *w = words[(r >> 8) % word_cnt];
+            for (; *w != '\0' && i < len; w++, col++) {
+                buf[i++] = (Bytef)*w;
+            }
+        }
+        if (i < len && col != 0) {
+            buf[i++] = ' ';
+            col++;
+        }
+    }
+    return buf;
+}
+
+static double now(void) {
+    struct timespec ts;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void check_round_trip(
+    const Bytef *data,
+    size_t len,
+    const Bytef *comp,
+    size_t comp_len
+) {
+    uLongf out_len = (uLongf)len;
+    Bytef *out = malloc(len);
+    if (out == NULL
+        || uncompress(out, &out_len, comp, (uLong)comp_len) != Z_OK
+        || out_len != len || memcmp(out, data, len) != 0)
+    {
+        (void)fprintf(stderr, "round trip through uncompress() failed\n");
+        exit(EXIT_FAILURE);
+    }
+    free(out);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    unsigned long max_threads = 0;
+    unsigned long size_mb = 32;
+
+    while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+        unsigned long *arg = ch == 'n' ? &max_threads : &size_mb;
+        switch (ch) {
+            case 'n':
+            case 's':
+                errno = 0;
+                *arg = strtoul(optarg, NULL, 0);
+                if (errno != 0 || *arg == 0 || *arg > 4096) {
+                    (void)fprintf(stderr, "invalid -%c argument\n", ch);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                (void)fprintf(
+                    stderr,
+                    "usage: bench_pdeflate [-n max_threads] [-s size_mb]\n"
+                );
+                return EXIT_FAILURE;
+        }
+    }
+    if (max_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_threads = cpus < 1 ? 1 : (unsigned long)cpus;
+    }
+
+    size_t len = size_mb * 1024 * 1024;
+    double mb = (double)len / (1024 * 1024);
+    Bytef *data = make_input(len);
+
+    uLongf base_len = compressBound((uLong)len);
+    Bytef *base = malloc(base_len);
+    double start = now();
+    if (base == NULL || compress(base, &base_len, data, (uLong)len) != Z_OK) {
+        (void)fprintf(stderr, "compression failed\n");
+        return EXIT_FAILURE;
+    }
+    double base_time = now() - start;
+    free(base);
+
+    (void)printf(
+        "%zu bytes, compress(): %.1f MB/s, ratio %.3f\n",
+        len,
+        mb / base_time,
+        (double)base_len / (double)len
+    );
+    (void)printf(
+        "%8s %12s %8s %12s %8s %8s\n",
+        "threads",
+        "deflate MB/s",
+        "speedup",
+        "inflate MB/s",
+        "speedup",
+        "ratio"
+    );
+    double deflate_1 = 0;
+    double inflate_1 = 0;
+    for (unsigned int threads = 1; threads <= max_threads; threads++) {
+        Bytef *comp;
+        size_t comp_len;
+        start = now();
+        if (pdeflate(data, len, threads, &comp, &comp_len) == -1) {
+            (void)fprintf(stderr, "pdeflate failed\n");
+            return EXIT_FAILURE;
+        }
+        double deflate_time = now() - start;
+
+        Bytef *out;
+        size_t out_len;
+        start = now();
+        if (pinflate(comp, comp_len, threads, &out, &out_len) != 0) {
+            (void)fprintf(stderr, "pinflate failed\n");
+            return EXIT_FAILURE;
+        }
+        double inflate_time = now() - start;
+        if (out_len != len || memcmp(out, data, len) != 0) {
+            (void)fprintf(stderr, "round trip through pinflate() failed\n");
+            return EXIT_FAILURE;
+        }
+        free(out);
+        check_round_trip(data, len, comp, comp_len);
+
+        if (threads == 1) {
+            deflate_1 = deflate_time;
+            inflate_1 = inflate_time;
+        }
+        (void)printf(
+            "%8u %12.1f %7.2fx %12.1f %7.2fx %8.3f\n",
+            threads,
+            mb / deflate_time,
+            deflate_1 / deflate_time,
+            mb / inflate_time,
+            inflate_1 / inflate_time,
+            (double)comp_len / (double)len
+        );
+        free(comp);
+    }
+
+    free(data);
+    return EXIT_SUCCESS;
+}
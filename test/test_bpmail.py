@@ -1,7 +1,9 @@
 from __future__ import annotations
 
 import os
+import signal
 import subprocess
+import time
 from typing import TYPE_CHECKING
 
 import pytest
@@ -49,6 +51,47 @@ def run_bpmailrecv(
     )
 
 
+def start_bpmaild(*cmdline: str) -> subprocess.Popen:
+    bpmaild_path = os.getenv('TEST_BPMAILD_BINARY', 'bpmaild')
+    return subprocess.Popen(
+        [bpmaild_path] + list(cmdline),
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+    )
+
+
+def run_bpmaild(
+    *cmdline: str, capture_output: bool = True, check: bool = True
+) -> subprocess.CompletedProcess:
+    bpmaild_path = os.getenv('TEST_BPMAILD_BINARY', 'bpmaild')
+    return subprocess.run(
+        [bpmaild_path] + list(cmdline), capture_output=capture_output, check=check
+    )
+
+
+def run_bpmailtrace(
+    *cmdline: str, input=None, check: bool = True
+) -> subprocess.CompletedProcess:
+    bpmailtrace_path = os.getenv('TEST_BPMAILTRACE_BINARY', 'bpmailtrace')
+    return subprocess.run(
+        [bpmailtrace_path] + list(cmdline),
+        input=input,
+        capture_output=True,
+        check=check,
+    )
+
+
+def wait_for_file(path, timeout: float = 30) -> bytes:
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if path.exists() and path.stat().st_size > 0:
+            # Give the delivery command time to finish writing
+            time.sleep(0.5)
+            return path.read_bytes()
+        time.sleep(0.1)
+    raise TimeoutError(f'{path} was not written')
+
+
 def peek_line(f: BinaryIO) -> bytes:
     pos = f.tell()
     line = f.readline()
@@ -173,6 +216,131 @@ def test_allow_invalid_mime(self):
             assert b'could not parse MIME message' in recv.stderr
             assert data == recv.stdout
 
+    def test_header_compression(self, tmp_path):
+        # Node 1 sends to itself, so receiving with the same tables acknowledges
+        # the fields each message added, and the third message refers to them
+        for name in (
+            'node_nbr_1_one_addr.eml',
+            'node_nbr_1_mult_addr.eml',
+            'node_nbr_1_one_addr.eml',
+        ):
+            with open(f'{messages_prefix}/{name}', mode='rb') as m:
+                ret_path = peek_line(m)
+                data = m.read()
+                run_bpmailsend('-H', str(tmp_path), profile_id, dest_eid, input=data)
+                recv = run_bpmailrecv(recv_s_arg, '-H', str(tmp_path))
+                assert ret_path not in recv.stdout
+                assert data.removeprefix(ret_path) == recv.stdout
+
+    def test_header_compression_lost_message(self, tmp_path):
+        state_dir = tmp_path / 'state'
+        lost_dir = tmp_path / 'lost'
+        for d in (state_dir, lost_dir):
+            d.mkdir()
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        for _ in range(2):
+            run_bpmailsend('-H', str(state_dir), profile_id, dest_eid, input=data)
+            run_bpmailrecv(recv_s_arg, '-H', str(state_dir))
+        run_bpmailsend('-H', str(state_dir), profile_id, dest_eid, input=data)
+        # Receive with other tables, as if the message never reached state_dir
+        run_bpmailrecv(recv_s_arg, '-H', str(lost_dir))
+        run_bpmailsend('-H', str(state_dir), profile_id, dest_eid, input=data)
+        recv = run_bpmailrecv(recv_s_arg, '-H', str(state_dir))
+        assert data.removeprefix(ret_path) == recv.stdout
+
+    def test_header_compression_unparsable_header(self, tmp_path):
+        with open(f'{messages_prefix}/batch_smtp.txt', mode='rb') as m:
+            data = m.read()
+            run_bpmailsend('-H', str(tmp_path), profile_id, dest_eid, input=data)
+            recv = run_bpmailrecv('--allow-invalid-mime', '-H', str(tmp_path))
+            assert data == recv.stdout
+
+    def test_duplicate_discarded(self, tmp_path):
+        dedup_file = str(tmp_path / 'dedup')
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        run_bpmailsend(profile_id, dest_eid, input=data)
+        recv = run_bpmailrecv(recv_s_arg, '-D', dedup_file, '--dedup-exact')
+        assert data.removeprefix(ret_path) == recv.stdout
+
+        # Identical payload, as if the bundle was retransmitted
+        run_bpmailsend(profile_id, dest_eid, input=data)
+        recv = run_bpmailrecv(recv_s_arg, '-D', dedup_file, '--dedup-exact')
+        assert recv.stdout == b''
+        assert b'duplicate message discarded' in recv.stderr
+
+        # A different message is still delivered
+        with open(f'{messages_prefix}/node_nbr_1_mult_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        run_bpmailsend(profile_id, dest_eid, input=data)
+        recv = run_bpmailrecv(recv_s_arg, '-D', dedup_file, '--dedup-exact')
+        assert data.removeprefix(ret_path) == recv.stdout
+
+    def test_duplicate_window_expiry(self, tmp_path):
+        dedup_file = str(tmp_path / 'dedup')
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        for _ in range(2):
+            run_bpmailsend(profile_id, dest_eid, input=data)
+            recv = run_bpmailrecv(
+                recv_s_arg, '-D', dedup_file, '--dedup-window', '1'
+            )
+            assert data.removeprefix(ret_path) == recv.stdout
+            # Digests are forgotten after two windows at most
+            time.sleep(2.5)
+
+    def test_parallel_compression(self):
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        # Large enough to be split into several blocks
+        data += b''.join(b'line %d of a long message\r\n' % i for i in range(40000))
+        for recv_args in (('-j', '4'), ()):
+            run_bpmailsend('-j', '4', profile_id, dest_eid, input=data)
+            recv = run_bpmailrecv(recv_s_arg, *recv_args)
+            assert data.removeprefix(ret_path) == recv.stdout
+
+    def test_trace(self, tmp_path):
+        send_log = tmp_path / 'send.log'
+        recv_log = tmp_path / 'recv.log'
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        run_bpmailsend('-T', str(send_log), profile_id, dest_eid, input=data)
+        recv = run_bpmailrecv(recv_s_arg, '-T', str(recv_log))
+        # The trace record is not part of the delivered message
+        assert data.removeprefix(ret_path) == recv.stdout
+
+        send_fields = send_log.read_text().split()
+        recv_fields = recv_log.read_text().split()
+        assert send_fields[0] == 'send'
+        assert f'dest={dest_eid}' in send_fields
+        assert recv_fields[0] == 'recv'
+        # The span continues the trace started by the sender
+        assert recv_fields[1] == send_fields[1]
+        assert recv_fields[3] == send_fields[3]
+        for stage in ('compress', 'transit', 'verify', 'deliver', 'total'):
+            assert any(f.startswith(f'{stage}=') for f in recv_fields)
+
+        trace = run_bpmailtrace(str(send_log), str(recv_log))
+        assert b'sent to ipn:1: 1 spans' in trace.stdout
+        assert b'received from ipn:1: 1 spans' in trace.stdout
+
+    def test_trace_not_logged_without_record(self, tmp_path):
+        recv_log = tmp_path / 'recv.log'
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        run_bpmailsend(profile_id, dest_eid, input=data)
+        recv = run_bpmailrecv(recv_s_arg, '-T', str(recv_log))
+        assert data.removeprefix(ret_path) == recv.stdout
+        assert not recv_log.exists()
+
     def test_send_no_content(self):
         send = run_bpmailsend(profile_id, dest_eid, check=False)
         assert send.returncode != 0
@@ -186,6 +354,165 @@ def test_send_unknown_profile(self):
         )
         assert send.returncode != 0
 
+    def test_daemon_send_and_receive_same_topic(self, tmp_path):
+        spool = tmp_path / 'spool'
+        out = tmp_path / 'out.eml'
+        (spool / '25').mkdir(parents=True)
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        (spool / '25' / '.msg').write_bytes(data)
+        (spool / '25' / '.msg').rename(spool / '25' / 'msg')
+
+        daemon = start_bpmaild(
+            '-s',
+            f'{dns_addr}:{dns_port}',
+            '-c',
+            f'cat > {out}',
+            '-d',
+            str(spool),
+            f'25:{profile_id}:{dest_eid}',
+        )
+        try:
+            delivered = wait_for_file(out)
+        finally:
+            daemon.send_signal(signal.SIGINT)
+            _, stderr = daemon.communicate(timeout=30)
+        assert daemon.returncode == 0
+        assert ret_path not in delivered
+        assert data.removeprefix(ret_path) == delivered
+        assert not (spool / '25' / 'msg').exists()
+        assert b'topic 25: 1 sent, 0 send failures, 1 delivered' in stderr
+
+    def test_daemon_multiple_topics(self, tmp_path):
+        spool = tmp_path / 'spool'
+        maildir = tmp_path / 'Maildir'
+        (spool / '25').mkdir(parents=True)
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path_25 = peek_line(m)
+            data_25 = m.read()
+        with open(f'{messages_prefix}/node_nbr_1_mult_addr.eml', mode='rb') as m:
+            ret_path_26 = peek_line(m)
+            data_26 = m.read()
+        # Queued for topic 26 before the daemon opens it; only one application
+        # can have a topic open
+        run_bpmailsend('-t', '26', profile_id, dest_eid, input=data_26)
+        (spool / '25' / '.msg').write_bytes(data_25)
+        (spool / '25' / '.msg').rename(spool / '25' / 'msg')
+
+        daemon = start_bpmaild(
+            '-s',
+            f'{dns_addr}:{dns_port}',
+            '-m',
+            str(maildir),
+            '-d',
+            str(spool),
+            f'25:{profile_id}:{dest_eid}',
+            '26',
+        )
+        try:
+            deadline = time.monotonic() + 30
+            while time.monotonic() < deadline:
+                new = maildir / 'new'
+                if new.exists() and len(list(new.iterdir())) == 2:
+                    break
+                time.sleep(0.1)
+        finally:
+            daemon.send_signal(signal.SIGINT)
+            _, stderr = daemon.communicate(timeout=30)
+        assert daemon.returncode == 0
+        delivered = sorted(f.read_bytes() for f in (maildir / 'new').iterdir())
+        assert delivered == sorted(
+            [data_25.removeprefix(ret_path_25), data_26.removeprefix(ret_path_26)]
+        )
+        assert not (spool / '26').exists()
+        assert (
+            b'topic 25: 1 sent, 0 send failures, 1 delivered, 0 duplicates,'
+            b' 0 rejected' in stderr
+        )
+        assert (
+            b'topic 26: 0 sent, 0 send failures, 1 delivered, 0 duplicates,'
+            b' 0 rejected' in stderr
+        )
+
+    def test_daemon_maildir(self, tmp_path):
+        spool = tmp_path / 'spool'
+        maildir = tmp_path / 'Maildir'
+        (spool / '25').mkdir(parents=True)
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            ret_path = peek_line(m)
+            data = m.read()
+        (spool / '25' / '.msg').write_bytes(data)
+        (spool / '25' / '.msg').rename(spool / '25' / 'msg')
+
+        daemon = start_bpmaild(
+            '-s',
+            f'{dns_addr}:{dns_port}',
+            '-m',
+            str(maildir),
+            '--commit-window',
+            '50',
+            '-d',
+            str(spool),
+            f'25:{profile_id}:{dest_eid}',
+        )
+        try:
+            deadline = time.monotonic() + 30
+            while time.monotonic() < deadline:
+                if (maildir / 'new').exists() and any((maildir / 'new').iterdir()):
+                    break
+                time.sleep(0.1)
+        finally:
+            daemon.send_signal(signal.SIGINT)
+            _, stderr = daemon.communicate(timeout=30)
+        assert daemon.returncode == 0
+        # Messages only appear in new once they are complete
+        delivered = list((maildir / 'new').iterdir())
+        assert len(delivered) == 1
+        assert data.removeprefix(ret_path) == delivered[0].read_bytes()
+        assert not any((maildir / 'tmp').iterdir())
+        assert (maildir / 'cur').is_dir()
+        assert b'topic 25: 1 sent, 0 send failures, 1 delivered' in stderr
+
+    def test_daemon_maildir_duplicate_pending(self, tmp_path):
+        spool = tmp_path / 'spool'
+        maildir = tmp_path / 'Maildir'
+        (spool / '25').mkdir(parents=True)
+        with open(f'{messages_prefix}/node_nbr_1_one_addr.eml', mode='rb') as m:
+            data = m.read()
+        # Identical payloads, as if the bundle was retransmitted
+        for name in ('msg1', 'msg2'):
+            (spool / '25' / f'.{name}').write_bytes(data)
+            (spool / '25' / f'.{name}').rename(spool / '25' / name)
+
+        # The copy arrives while the original still waits for its commit
+        daemon = start_bpmaild(
+            '-s',
+            f'{dns_addr}:{dns_port}',
+            '-m',
+            str(maildir),
+            '--commit-window',
+            '3000',
+            '-D',
+            str(tmp_path / 'dedup'),
+            '-d',
+            str(spool),
+            f'25:{profile_id}:{dest_eid}',
+        )
+        try:
+            deadline = time.monotonic() + 30
+            while time.monotonic() < deadline:
+                if (maildir / 'new').exists() and any((maildir / 'new').iterdir()):
+                    break
+                time.sleep(0.1)
+            time.sleep(1)
+        finally:
+            daemon.send_signal(signal.SIGINT)
+            _, stderr = daemon.communicate(timeout=30)
+        assert daemon.returncode == 0
+        assert len(list((maildir / 'new').iterdir())) == 1
+        assert b'2 sent, 0 send failures, 1 delivered, 1 duplicates' in stderr
+
 
 def test_send_missing_args():
     send = run_bpmailsend(check=False)
@@ -235,12 +562,96 @@ def test_recv_topic_id_validation():
     assert b'strtoul' in recv.stderr
 
 
+def test_recv_dedup_window_validation():
+    recv = run_bpmailrecv('-D', os.devnull, '--dedup-window', '0', check=False)
+    assert recv.returncode != 0
+    assert b'dedup window out of range' in recv.stderr
+
+    recv = run_bpmailrecv('-D', os.devnull, '--dedup-window', 'blah', check=False)
+    assert recv.returncode != 0
+    assert b'strtoul' in recv.stderr
+
+
+def test_threads_validation():
+    send = run_bpmailsend('-j', '0', profile_id, dest_eid, check=False)
+    assert send.returncode != 0
+    assert b'threads out of range' in send.stderr
+
+    recv = run_bpmailrecv('-j', 'blah', check=False)
+    assert recv.returncode != 0
+    assert b'strtoul' in recv.stderr
+
+    daemon = run_bpmaild('-c', 'cat', '-j', '100000', '25', check=False)
+    assert daemon.returncode != 0
+    assert b'threads out of range' in daemon.stderr
+
+
 def test_recv_extra_args():
     recv = run_bpmailrecv('blah', check=False)
     assert recv.returncode != 0
     assert b'usage' in recv.stderr
 
 
+def test_daemon_usage():
+    daemon = run_bpmaild(check=False)
+    assert daemon.returncode != 0
+    assert b'usage' in daemon.stderr
+
+    # Sending requires a spool directory
+    daemon = run_bpmaild('-c', 'cat', f'25:{profile_id}:{dest_eid}', check=False)
+    assert daemon.returncode != 0
+    assert b'usage' in daemon.stderr
+
+    daemon = run_bpmaild('-c', 'cat', f'{2**33}', check=False)
+    assert daemon.returncode != 0
+    assert b'topic_id out of range' in daemon.stderr
+
+    daemon = run_bpmaild('-c', 'cat', '25:1', check=False)
+    assert daemon.returncode != 0
+    assert b'invalid topic' in daemon.stderr
+
+    # Exactly one of a delivery command and a Maildir is required
+    daemon = run_bpmaild('25', check=False)
+    assert daemon.returncode != 0
+    assert b'usage' in daemon.stderr
+
+    daemon = run_bpmaild('-c', 'cat', '-m', os.devnull, '25', check=False)
+    assert daemon.returncode != 0
+    assert b'usage' in daemon.stderr
+
+    daemon = run_bpmaild('-m', os.devnull, '--commit-window', '-', '25', check=False)
+    assert daemon.returncode != 0
+    assert b'strtoul' in daemon.stderr
+
+
+def test_trace_histograms():
+    log = (
+        b'recv id=01 src=ipn:2.25 time=1 read=10 transit=1500 total=2000\n'
+        b'recv id=02 src=ipn:2.25 time=2 read=12 transit=3000 total=4000\n'
+        b'recv id=03 src=ipn:3.25 time=3 read=9 transit=-20 total=900\n'
+        b'not a span\n'
+        b'send id=04 dest=ipn:2.25 time=4 read=5 dtpc=7 total=30\n'
+    )
+    trace = run_bpmailtrace(input=log)
+    assert b'1 malformed lines ignored' in trace.stderr
+    out = trace.stdout.decode()
+    assert 'received from all nodes: 3 spans' in out
+    assert 'received from ipn:2: 2 spans' in out
+    assert 'received from ipn:3: 1 spans' in out
+    assert 'sent to ipn:2: 1 spans' in out
+    # Clock skew shows up as negative transit times
+    assert 'negative' in out
+    assert '[    1.0ms,     2.0ms)        1 #' in out
+
+    trace = run_bpmailtrace('-q', input=log)
+    assert b'negative' not in trace.stdout
+    assert b'p99' in trace.stdout
+    # Negative times are counted as skew and left out of the percentiles
+    lines = [' '.join(line.split()) for line in trace.stdout.decode().splitlines()]
+    assert 'transit 3 1 1.5ms 3.0ms 3.0ms 3.0ms' in lines
+    assert 'transit 1 1 - - - -' in lines
+
+
 def test_send_ion_not_running():
     send = run_bpmailsend(profile_id, dest_eid, check=False)
     assert send.returncode != 0
@@ -251,3 +662,9 @@ def test_recv_ion_not_running():
     recv = run_bpmailrecv(check=False)
     assert recv.returncode != 0
     assert b'could not attach to DTPC' in recv.stderr
+
+
+def test_daemon_ion_not_running():
+    daemon = run_bpmaild('--no-verify-ipn', '-c', 'cat', '25', check=False)
+    assert daemon.returncode != 0
+    assert b'could not attach to DTPC' in daemon.stderr
@@ -0,0 +1,161 @@
+/*
+ * Tests for the duplicate filter: duplicates are detected, the false positive
+ * rate stays near the designed rate (and is zero with the exact index), digests
+ * expire after the window, a clock stepping backwards does not expire them, and
+ * the filter survives being reopened.
+ */
+#include "dedup.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WINDOW 10
+#define MEMBERS 100000
+#define NON_MEMBERS 100000
+#define EXACT_NON_MEMBERS 2000
+
+static char dir[] = "/tmp/test_dedup.XXXXXX";
+static char path[sizeof(dir) + 16];
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            (void)fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+/* Fill `digest` with pseudo-random bytes (xorshift64*) */
+static void random_digest(unsigned char *digest) {
+    for (size_t i = 0; i < DEDUP_DIGEST_LEN; i += sizeof(uint64_t)) {
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        uint64_t v = rng_state * 0x2545f4914f6cdd1dULL;
+        memcpy(digest + i, &v, sizeof(v));
+    }
+}
+
+static void remove_files(void) {
+    char index_path[sizeof(path) + 2];
+    for (unsigned int i = 0; i < 2; i++) {
+        (void)snprintf(index_path, sizeof(index_path), "%s.%u", path, i);
+        (void)unlink(index_path);
+    }
+    (void)unlink(path);
+}
+
+static void test_duplicates(void) {
+    unsigned char a[DEDUP_DIGEST_LEN];
+    unsigned char b[DEDUP_DIGEST_LEN];
+    random_digest(a);
+    random_digest(b);
+
+    struct dedup *d = dedup_open(path, WINDOW, 0);
+    CHECK(d != NULL);
+    CHECK(dedup_check(d, a, 1000) == 0);
+    CHECK(dedup_add(d, a, 1000) == 0);
+    CHECK(dedup_check(d, a, 1001) == 1);
+    CHECK(dedup_check(d, b, 1001) == 0);
+    dedup_close(d);
+
+    /* The filter survives being reopened */
+    d = dedup_open(path, WINDOW, 0);
+    CHECK(d != NULL);
+    CHECK(dedup_check(d, a, 1002) == 1);
+    CHECK(dedup_check(d, b, 1002) == 0);
+    dedup_close(d);
+    remove_files();
+}
+
+static void test_window_expiry(void) {
+    unsigned char a[DEDUP_DIGEST_LEN];
+    unsigned char b[DEDUP_DIGEST_LEN];
+    random_digest(a);
+    random_digest(b);
+
+    struct dedup *d = dedup_open(path, WINDOW, 0);
+    CHECK(d != NULL);
+    CHECK(dedup_add(d, a, 1000) == 0);
+    /* Rotates at 1015; `a` is now in the previous filter */
+    CHECK(dedup_check(d, a, 1015) == 1);
+    CHECK(dedup_add(d, b, 1016) == 0);
+    CHECK(dedup_check(d, a, 1024) == 1);
+    /* Rotates at 1025, clearing the filter holding `a` */
+    CHECK(dedup_check(d, a, 1025) == 0);
+    CHECK(dedup_check(d, b, 1025) == 1);
+    /* More than two windows later, everything has expired */
+    CHECK(dedup_check(d, b, 1025 + 2 * WINDOW) == 0);
+    dedup_close(d);
+    remove_files();
+}
+
+static void test_clock_step_back(void) {
+    unsigned char a[DEDUP_DIGEST_LEN];
+    random_digest(a);
+
+    struct dedup *d = dedup_open(path, WINDOW, 1);
+    CHECK(d != NULL);
+    CHECK(dedup_add(d, a, 1000) == 0);
+    /* A small correction of the clock must not forget recent deliveries */
+    CHECK(dedup_check(d, a, 999) == 1);
+    CHECK(dedup_check(d, a, 1000) == 1);
+    /* Digests still expire once the clock has moved on */
+    CHECK(dedup_check(d, a, 1000 + 2 * WINDOW) == 0);
+    dedup_close(d);
+    remove_files();
+}
+
+static void test_false_positive_rate(int exact, unsigned int non_members) {
+    unsigned char digest[DEDUP_DIGEST_LEN];
+
+    struct dedup *d = dedup_open(path, WINDOW, exact);
+    CHECK(d != NULL);
+    for (unsigned int i = 0; i < MEMBERS; i++) {
+        random_digest(digest);
+        CHECK(dedup_add(d, digest, 1000) == 0);
+    }
+    unsigned int positives = 0;
+    for (unsigned int i = 0; i < non_members; i++) {
+        random_digest(digest);
+        positives += dedup_check(d, digest, 1000) == 1;
+    }
+    double rate = (double)positives / non_members;
+    (void)printf(
+        "false positive rate%s: %.4f (%u/%u)\n",
+        exact ? " with exact index" : "",
+        rate,
+        positives,
+        non_members
+    );
+    if (exact) {
+        CHECK(positives == 0);
+    } else {
+        CHECK(rate < 0.02);
+    }
+    dedup_close(d);
+    remove_files();
+}
+
+int main(void) {
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    (void)snprintf(path, sizeof(path), "%s/filter", dir);
+
+    test_duplicates();
+    test_window_expiry();
+    test_clock_step_back();
+    test_false_positive_rate(0, NON_MEMBERS);
+    test_false_positive_rate(1, EXACT_NON_MEMBERS);
+
+    (void)rmdir(dir);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
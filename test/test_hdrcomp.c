@@ -0,0 +1,224 @@
+/*
+ * Tests for header compression: messages are reproduced byte for byte when
+ * ADUs are lost or reordered, including across a new generation, and fields
+ * are referenced once the receiver has acknowledged them. Malformed ADUs are
+ * rejected without touching memory outside the tables.
+ */
+#include "hdrcomp.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ADUS 16
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            (void)fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+struct adu {
+    char msg[512];
+    size_t msg_len;
+    char *encoded;
+    size_t encoded_len;
+};
+
+static const struct hdr_ack no_ack = {0, 0};
+
+/* Message `i`; every message has a field with a value of its own */
+static void make_message(struct adu *a, unsigned int i) {
+    int len = snprintf(
+        a->msg,
+        sizeof(a->msg),
+        "From: sender@example.com\r\n"
+        "To: recipient@example.com\r\n"
+        "Subject: Report\r\n"
+        "X-Sequence: %u\r\n"
+        "\r\n"
+        "Body of message %u\r\n",
+        i,
+        i
+    );
+    a->msg_len = (size_t)len;
+}
+
+static void encode(struct hdr_table *send, struct adu *a, unsigned int i) {
+    make_message(a, i);
+    CHECK(
+        hdrcomp_encode(
+            send,
+            &no_ack,
+            a->msg,
+            a->msg_len,
+            &a->encoded,
+            &a->encoded_len
+        )
+        == 0
+    );
+    CHECK(a->encoded != NULL);
+}
+
+/* Returns 1 if `a` decodes to the message it was encoded from */
+static int decode(
+    struct hdr_recv_tables *recv,
+    struct hdr_table *send,
+    const struct adu *a
+) {
+    char *out;
+    size_t out_len;
+    struct hdr_ack ack;
+    if (a->encoded == NULL
+        || hdrcomp_decode(
+               recv,
+               &ack,
+               a->encoded,
+               a->encoded_len,
+               &out,
+               &out_len
+           )
+            == -1)
+    {
+        return 0;
+    }
+    int ok = out_len == a->msg_len && memcmp(out, a->msg, out_len) == 0;
+    free(out);
+
+    /* As if the receiving node sent an ADU back */
+    hdrcomp_ack(recv, &ack);
+    hdrcomp_acked(send, &ack);
+    return ok;
+}
+
+static void free_adus(struct adu *adus, size_t cnt) {
+    for (size_t i = 0; i < cnt; i++) {
+        free(adus[i].encoded);
+        adus[i].encoded = NULL;
+    }
+}
+
+static void test_acked_references(void) {
+    struct hdr_table *send = calloc(1, sizeof(*send));
+    struct hdr_recv_tables *recv = calloc(1, sizeof(*recv));
+    struct adu adus[3];
+    CHECK(send != NULL && recv != NULL);
+
+    /* Without an acknowledgment, fields are sent again in full */
+    encode(send, &adus[0], 0);
+    encode(send, &adus[1], 0);
+    CHECK(adus[1].encoded_len == adus[0].encoded_len);
+    CHECK(decode(recv, send, &adus[0]));
+    CHECK(decode(recv, send, &adus[1]));
+
+    encode(send, &adus[2], 0);
+    CHECK(adus[2].encoded_len < adus[0].encoded_len);
+    CHECK(decode(recv, send, &adus[2]));
+    free_adus(adus, 3);
+    free(send);
+    free(recv);
+}
+
+static void test_lost(void) {
+    struct hdr_table *send = calloc(1, sizeof(*send));
+    struct hdr_recv_tables *recv = calloc(1, sizeof(*recv));
+    struct adu adus[ADUS];
+    CHECK(send != NULL && recv != NULL);
+
+    for (unsigned int i = 0; i < ADUS; i++) {
+        encode(send, &adus[i], i);
+        /* Every other ADU is lost, starting with the one inserting the fields
+         * all messages have in common */
+        if (i % 2 == 1) {
+            CHECK(decode(recv, send, &adus[i]));
+        }
+    }
+    free_adus(adus, ADUS);
+    free(send);
+    free(recv);
+}
+
+static void test_reordered(void) {
+    struct hdr_table *send = calloc(1, sizeof(*send));
+    struct hdr_recv_tables *recv = calloc(1, sizeof(*recv));
+    struct adu adus[ADUS];
+    CHECK(send != NULL && recv != NULL);
+
+    encode(send, &adus[0], 0);
+    CHECK(decode(recv, send, &adus[0]));
+    for (unsigned int i = 1; i < ADUS; i++) {
+        encode(send, &adus[i], i);
+    }
+    /* Arrive last first, each acknowledging more entries */
+    for (unsigned int i = ADUS - 1; i > 0; i--) {
+        CHECK(decode(recv, send, &adus[i]));
+    }
+    free_adus(adus, ADUS);
+    free(send);
+    free(recv);
+}
+
+static void test_new_generation(void) {
+    struct hdr_table *send = calloc(1, sizeof(*send));
+    struct hdr_recv_tables *recv = calloc(1, sizeof(*recv));
+    struct adu old;
+    struct adu adu;
+    CHECK(send != NULL && recv != NULL);
+
+    /* Fill the table, then hold back the last ADU of the generation */
+    unsigned int i = 0;
+    uint32_t generation;
+    do {
+        encode(send, &old, i++);
+        generation = send->generation;
+        if (send->insert_count < HDRCOMP_DYN_ENTRIES
+            || send->adus < HDRCOMP_GENERATION_ADUS)
+        {
+            CHECK(decode(recv, send, &old));
+            free_adus(&old, 1);
+        }
+    } while (old.encoded == NULL && i < 1000);
+    CHECK(i < 1000);
+
+    encode(send, &adu, i);
+    CHECK(send->generation > generation);
+    CHECK(decode(recv, send, &adu));
+    /* The ADU of the previous generation still decodes */
+    CHECK(decode(recv, send, &old));
+    free_adus(&adu, 1);
+    free_adus(&old, 1);
+    free(send);
+    free(recv);
+}
+
+static void test_insert_out_of_range(void) {
+    struct hdr_recv_tables *recv = calloc(1, sizeof(*recv));
+    CHECK(recv != NULL);
+
+    /* base = UINT64_MAX, so the first insert would be numbered 0 */
+    static const char in[] = {
+        0x00, 'H',  0x02, 0x01, 0x01, '\xff', '\xff', '\xff', '\xff',
+        '\xff', '\xff', '\xff', '\xff', '\xff', 0x01, 0x00, 0x00,
+        0x07, 0x01, 'X',  0x02, ' ',  'y',  0x00, '\n',
+    };
+    char *out = NULL;
+    size_t out_len;
+    struct hdr_ack ack;
+    CHECK(hdrcomp_decode(recv, &ack, in, sizeof(in), &out, &out_len) == -1);
+    CHECK(out == NULL);
+    CHECK(recv->cur.insert_count == 0);
+    free(recv);
+}
+
+int main(void) {
+    test_acked_references();
+    test_lost();
+    test_reordered();
+    test_new_generation();
+    test_insert_out_of_range();
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}